@@ -478,6 +478,26 @@ class attributesC : public common::attributesC, public sightObj
   
   // Returns the result of the current query q on the current state of this attributes object
   bool query();
+  
+  // --- SAMPLING ---
+  private:
+  // The number of blocks suppressed by their sampling policies that enclose the current point in the calling
+  // thread's execution. While it is non-zero query() returns false, suppressing all output inside these blocks.
+  static __thread int suppressDepth;
+  
+  public:
+  // Records entry into / exit from a block suppressed by its sampling policy
+  void pushSuppression() { suppressDepth++; }
+  void popSuppression()  { if(suppressDepth>0) suppressDepth--; }
+  
+  // Re-enables output on the calling thread regardless of the suppressed blocks that are still open and returns
+  // the number of such blocks, which may later be passed to restoreSuppression(). Used when Sight is shutting 
+  // down and must emit records about the elided sampled objects.
+  int resetSuppression() { int depth=suppressDepth; suppressDepth=0; return depth; }
+  void restoreSuppression(int depth) { suppressDepth=depth; }
+  
+  // Returns whether the calling thread is currently inside a block suppressed by its sampling policy
+  bool suppressed() const { return suppressDepth>0; }
 };
 
 extern structure::attributesC attributes;
@@ -16,8 +16,11 @@
 #include <list>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include "sight_common_internal.h"
 //#include "sight_layout.h"
 
@@ -36,7 +39,15 @@ class baseStructureParser : public common::structureParser {
   size_t dataInBuf;
   
   // The current index of the read pointer within buf[]
-  int bufIdx;
+  size_t bufIdx;
+  
+  // The offset within the stream of buf[0]
+  unsigned long streamOffset;
+  
+  // The offsets within the stream of the first character of the last text or tag read by nextTag() and of the
+  // character that follows it
+  unsigned long eventStart;
+  unsigned long eventEnd;
   
   // Reference to the data source
   streamT* stream;
@@ -58,6 +69,13 @@ class baseStructureParser : public common::structureParser {
   baseStructureParser(streamT* stream, int bufSize=10000);
   void init(streamT* stream);
   
+  protected:
+  // Restarts parsing at the given offset within the stream, after the data source has been repositioned there. 
+  // The call paths defined in the parts of the stream read so far remain defined, so a caller that resumes in
+  // the middle of the stream must first read the definitions of the call paths that the rest refers to (see 
+  // SubtreeStructureParser).
+  void restart(unsigned long offset);
+  
   protected:
   // The location within nextLoc() at which the last call to newLoc() stopped and the
   // next newLoc() call will resume.
@@ -65,19 +83,65 @@ class baseStructureParser : public common::structureParser {
                 textRead,
                 enterTagRead,
                 exitTagRead,
+                binaryRead,
                 done} codeLoc;
   codeLoc loc;
   
   // The properties of the object tag that is being currently read
   properties tagProperties;
   
+  // If the stream uses the binary encoding, the dictionary of tag names and property keys read so far,
+  // indexed by their IDs
+  std::vector<std::string> binaryDict;
+  
+  // Records whether the exit record of the outermost sight object of a binary stream has been read, 
+  // which marks the end of the log
+  bool binarySightExited;
+  
+  // Maps the IDs of the call paths defined in the stream via callPathDef tags to their string representations
+  std::map<long, std::string> callPaths;
+
   
   public:
   // Reads more data from the data source, returning the type of the next tag read and the properties of 
   // the object it denotes.
+  // Call path definitions are consumed by next() and references to them via callPathID keys are replaced 
+  // with the corresponding callPath keys.
   std::pair<properties::tagType, const properties*> next();
   
+  // Return the offsets within the stream of the first character of the text or tag last returned by next() and
+  // of the character that follows it. For a tag that encodes multiple levels of an object's hierarchy the range
+  // covers all the levels. Offsets are counted in the uncompressed text of the log.
+  unsigned long lastStart() const { return eventStart; }
+  unsigned long lastEnd()   const { return eventEnd; }
+  
   protected:
+  // Reads the next tag from the stream, including call path definitions
+  std::pair<properties::tagType, const properties*> nextTag();
+  
+  public:
+  // Replaces all the callPathID keys in props with callPath keys that map to the corresponding call paths in
+  // callPaths
+  static void resolveCallPaths(properties& props, const std::map<long, std::string>& callPaths);
+  
+  protected:
+  
+  // Variant of next() that is used once we've determined that the stream uses the binary encoding
+  std::pair<properties::tagType, const properties*> nextBinary();
+  
+  // Reads the body of a binary enterTag record into tagProperties. Returns true on success and false if
+  // the end of the stream was reached.
+  bool readBinaryEnterTag();
+  
+  // Reads the next byte/varint/length-prefixed string from the binary stream. Return true on success and
+  // false if the end of the stream was reached.
+  bool readBinaryByte(unsigned char& c);
+  bool readBinaryVarint(unsigned long& v);
+  bool readBinaryString(std::string& s);
+  
+  // Returns the dictionary entry with the given ID, yelling if it has not been defined
+  const std::string& binaryDictName(unsigned long ID);
+  
   // Read a property name/value pair from the given file, setting name and val to them.
   // Reading starts at buf[bufIdx] and continues as far as needed, reading more file 
   // contents into buf if the end of buf is reached. bufSize is the number of bytes in 
@@ -112,23 +176,74 @@ class baseStructureParser : public common::structureParser {
   // Returns the read char. If there is a next character in the file, returns true.
   // Otherwise, returns false.
   bool nextChar();
-  
-  // Returns true if character c is in array termChars of size numTermChars and 
-  // false otherwise.
-  static bool isMember(char c, const char* termChars, int numTermChars);
 };
 
 
+// The interval in milliseconds at which a FILEStructureParser in follow mode checks whether its file has grown
+// when it is not notified of the growth
+static const int followPollMS = 200;
+
 class FILEStructureParser : public baseStructureParser<FILE> {
   // Records whether this object opened the file on its own (in which case it needs to close it)
   // or was given a ready FILE* stream
   bool openedFile;
   
+  // Records whether the format of the file has been determined by examining its first bytes
+  bool formatChecked;
+  
+  // Records whether the file holds a compressed log (SIGHT_COMPRESS), which is decompressed as it is read
+  bool compressed;
+  
+  // Records whether the file holds an uncompressed text log and whether the zero-filled tail that follows
+  // it has been reached
+  bool text;
+  bool zeroTail;
+  
+  // If compressed, the uncompressed contents of the current frame, the read position within it and whether 
+  // all the frames have been read
+  std::string frame;
+  size_t frameIdx;
+  bool framesDone;
+  
+  // The name of the structure file, if the parser opened it
+  std::string fileName;
+  
+  // Records whether the parser follows a log that is still being written (see follow()), whether the end of
+  // the followed log has been reached and the last few characters read from it
+  bool following;
+  bool finished;
+  std::string lastChars;
+  
+  // If following, the inotify instance that reports writes to the file (-1 if none is available)
+  int inotifyFD;
+  
+  // If following, the time when the file last grew and the number of seconds without growth after which the
+  // log is considered complete (SIGHT_FOLLOW_TIMEOUT, 0 to wait indefinitely)
+  time_t lastGrowth;
+  int followTimeout;
+  
   public:
   FILEStructureParser(std::string fName, int bufSize=10000);
   FILEStructureParser(FILE* f, int bufSize=10000);
   ~FILEStructureParser();
   
+  // If the file holds a compressed log that ends with a frame index, positions the parser at the start of the
+  // last frame that begins at or before the given offset within the uncompressed log and returns true, setting 
+  // frameOffset to the uncompressed offset of the frame and depth to the nesting depth of the log's tags at 
+  // its start. Since parsing then resumes in the middle of the log, the tags that follow may include exits 
+  // from objects entered before the frame. If the file holds an uncompressed text log, positions the parser
+  // at the given offset itself and sets depth to -1, since the depth is not recorded. Returns false if the 
+  // file cannot be repositioned in this way.
+  bool seek(unsigned long rawOffset, unsigned long& frameOffset, int& depth);
+  
+  // Switches the parser to follow mode, in which reaching the end of the file means that the rest of the log
+  // has not been written yet rather than that the log is complete. Reads then wait for the file to grow, which
+  // is detected with inotify where it is available and by polling otherwise. The log is complete once its
+  // sight tag has been exited or the file has not grown for SIGHT_FOLLOW_TIMEOUT seconds, which allows for
+  // writers that are killed before completing the log. Must be called before any tags are read. Compressed 
+  // logs cannot be followed.
+  void follow();
+  
   protected:
   // Functions implemented by children of this class that specialize it to take input from various sources.
   
@@ -141,6 +256,307 @@ class FILEStructureParser : public baseStructureParser<FILE> {
   
   // Returns true if we've encountered an error in input stream
   bool streamError();
+  
+  private:
+  // readData() in follow mode: reads the next part of the log, waiting for it to be written if needed, and
+  // returns 0 once the log is complete
+  size_t followData();
+  
+  // Waits until the followed file may have grown. Returns false if the log should instead be considered 
+  // complete because the file has not grown within the timeout.
+  bool waitForGrowth();
+  
+
+  // Reads the next frame of a compressed log into frame. Returns true on success and false if there are no
+  // more frames.
+  bool readFrame();
+  
+  // Given the number of bytes just read into buf, returns the number of them that hold the log. A text log
+  // written through a memory mapping (SIGHT_MMAP_OUT) is followed by zeros if its writer was killed before it
+  // could truncate the file. As in MMapStructureParser, only a run of zeros that extends to the end of the file
+  // is taken to be this tail, since the log's text may itself contain NUL characters.
+  size_t textPrefix(size_t n);
+  
+  // Returns true if the part of the file that follows the given offset holds only zeros. The file is read with 
+  // pread(), so the read position of the stream is not disturbed. Returns false if the file cannot be read in 
+  // this way (e.g. it is a pipe).
+  bool zerosFollow(long offset);
+};
+
+// Parser that maps an entire structure file into memory and parses it in place. The whole log is presented to
+// the parser as a single buffer, so it is never copied or refilled, and the text, names and values of its tags
+// are extracted from the mapping in bulk. Values are only unescaped if they contain encoded characters.
+// Compressed logs (SIGHT_COMPRESS) are decompressed one frame at a time, straight from the mapping.
+class MMapStructureParser : public baseStructureParser<char> {
+  // The number of bytes mapped for the file and the number of them that hold the log, which excludes the
+  // zero-filled tail of a log whose memory-mapped writer (SIGHT_MMAP_OUT) was killed before truncating it
+  size_t mapLen;
+  size_t logLen;
+  
+  // Records whether the log has been handed to the parser
+  bool delivered;
+  
+  // Records whether the file holds a compressed log. If so, the uncompressed contents of the current frame,
+  // the offset within the mapping of the next frame and whether all the frames have been read.
+  bool compressed;
+  std::string frame;
+  size_t nextFrame;
+  bool framesDone;
+  
+  public:
+  // path: the structure file or the working directory that contains it
+  MMapStructureParser(std::string path);
+  ~MMapStructureParser();
+  
+  // If the file holds an uncompressed text log, returns a pointer to its mapped contents and sets len to
+  // its length. Returns NULL otherwise.
+  const char* textLog(size_t& len) const;
+  
+  protected:
+  // Functions implemented by children of this class that specialize it to take input from various sources.
+  
+  // readData() points buf[] to the entire log, or the next frame of a compressed log, and returns its size
+  size_t readData();
+  
+  // Returns true if we've reached the end of the input stream
+  bool streamEnd();
+  
+  // Returns true if we've encountered an error in input stream
+  bool streamError();
+};
+
+// Parser that reads the structure log that an application hands to the layout process through a 
+// common::shmRing in a shared memory segment (SIGHT_SHM_OUT). The log is parsed directly out of the segment,
+// without being copied into a separate buffer, and each region of the ring is released back to the
+// application once the parser moves past it.
+class SHMStructureParser : public baseStructureParser<common::shmRing> {
+  // The number of bytes mapped for the segment
+  size_t segmentSize;
+  
+  // The number of bytes at the start of the unconsumed part of the ring that buf currently points to
+  unsigned long held;
+  
+  // Records whether any data has been read from the ring
+  bool started;
+  
+  public:
+  // fd: the file descriptor of the shared memory segment, which the application passes to the layout
+  //     process in SIGHT_SHM_IN
+  SHMStructureParser(int fd);
+  ~SHMStructureParser();
+  
+  protected:
+  // Functions implemented by children of this class that specialize it to take input from various sources.
+  
+  // readData() points buf[] to the next contiguous region of the ring that holds data, waiting for the 
+  // application to write it if needed, and returns its size
+  size_t readData();
+  
+  // Returns true if we've reached the end of the input stream
+  bool streamEnd();
+  
+  // Returns true if we've encountered an error in input stream
+  bool streamError();
+};
+
+// Parses a large text structure log on a pool of threads. The mapped log is split into chunks that start at
+// tags that are not inside the multi-level encoding of an object's entry tag, so that each chunk can be
+// tokenized independently. Worker threads turn the chunks into arrays of tag events, which next() then 
+// delivers in order, resolving call path references along the way. The events are identical to those 
+// produced by MMapStructureParser on the same file. Only a sliding window of chunks is parsed ahead of
+// the chunk being consumed, which bounds the memory used for events.
+// The number of threads is set by SIGHT_PARSE_THREADS (default: the number of processors) and the size of 
+// the chunks in bytes by SIGHT_PARSE_CHUNK (default 8MB). Compressed and binary logs, logs that fit into a 
+// single chunk and runs with a single thread are parsed sequentially.
+class ParallelStructureParser : public common::structureParser {
+  // Parser that maps the file, which is used directly if the log is parsed sequentially
+  MMapStructureParser whole;
+  
+  // Records whether the log is parsed in parallel
+  bool parallel;
+  
+  // The mapped text log
+  const char* log;
+  size_t logLen;
+  
+  // The offsets within log at which the chunks start, followed by logLen
+  std::vector<size_t> chunkStart;
+  
+  // The maximum number of chunks that may be parsed ahead of the one being consumed
+  int window;
+  
+  std::vector<pthread_t> workers;
+  
+  // Protects all the fields below, which are shared with the workers
+  pthread_mutex_t mutex;
+  // Signaled when a chunk has been parsed and when the consumer moves on to the next chunk, respectively
+  pthread_cond_t parsedCond;
+  pthread_cond_t consumedCond;
+  
+  // The index of the next chunk to be handed to a worker
+  int nextChunk;
+  
+  // The index of the chunk currently being consumed by next()
+  int curChunk;
+  
+  // Maps the indexes of parsed chunks to their events. Each event is a tagType byte followed by an image of
+  // the tag's properties, written by properties::save().
+  std::map<int, std::string*> parsed;
+  
+  // Set to tell the workers to exit
+  bool stopping;
+  
+  // The events of the current chunk and the position of the next event within them
+  std::string* curEvents;
+  const char* curEvent;
+  
+  // The properties of the last tag returned by next()
+  properties tagProperties;
+  
+  // Maps the IDs of the call paths defined in the log to their string representations
+  std::map<long, std::string> callPaths;
+  
+  public:
+  // path: the structure file or the working directory that contains it
+  ParallelStructureParser(std::string path);
+  ~ParallelStructureParser();
+  
+  // Reads the next tag from the log, returning the type of the next tag read and the properties of 
+  // the object it denotes.
+  std::pair<properties::tagType, const properties*> next();
+  
+  protected:
+  // Returns the offset of the first tag at or after offset at which a chunk may start
+  size_t safeChunkStart(size_t offset);
+  
+  // Entry point of the worker threads
+  static void* workerMain(void* arg);
+  
+  // Tokenizes the given chunk, appending its events to events
+  void parseChunk(int idx, std::string& events);
+};
+
+// Parses the subtree of a structure log rooted at a given block, seeking directly to it using the block's entry
+// in the log's index (see structIndex). It delivers the log's sight tag, the block's entry tag, all the text 
+// and tags nested inside the block and its exit tag, followed by the exit from the sight tag. Before seeking to
+// the block, it reads the call path definitions that precede it, which it finds in the index, so that the 
+// call paths of the tags in the subtree are resolved as they are when the whole log is parsed.
+class SubtreeStructureParser : public common::structureParser {
+  FILEStructureParser parser;
+  
+  // The range of the log that holds the block's subtree
+  unsigned long start;
+  unsigned long end;
+  
+  // The properties of the log's sight tag and of its exit tag
+  properties sightProps;
+  properties sightExitProps;
+  
+  // The part of the output that next() is currently producing
+  typedef enum {sightEnter, subtree, sightExit, done} phaseT;
+  phaseT phase;
+  
+  // Returned by next() once all the tags have been delivered
+  properties noProps;
+  
+  public:
+  // path: the structure file or the working directory that contains it
+  // index: the log's index
+  // block: the entry of the subtree's root block in the index
+  SubtreeStructureParser(std::string path, const std::vector<common::structIndex::entry>& index, 
+                         const common::structIndex::entry& block);
+  
+  // Reads the next tag of the subtree, returning the type of the next tag read and the properties of 
+  // the object it denotes.
+  std::pair<properties::tagType, const properties*> next();
+};
+
+// Wraps another parser and renumbers the anchor and block IDs in its events in the order in which they first
+// appear. The events of a block's subtree are then the same wherever the block is in a log and whatever IDs the
+// application gave its anchors and blocks, so its layout can be cached by the contents of its events (see 
+// layoutCache). The anchor IDs are held in the anchorID, anchor_<i> and tAnchorID_<i> keys of any tag and in
+// the from/to and a/b keys of graph edges. The ID of noAnchor, -1, is left unchanged. Block IDs are held in the
+// ID key of blocks. They are left unchanged if REMOTE_ENABLED, since the layout then uses them to re-execute 
+// the application up to a given block.
+class RelocatedStructureParser : public common::structureParser {
+  common::structureParser& parser;
+  
+  // The offset tables that map each anchor ID and block ID that has been seen to its new ID
+  std::map<long, long> anchorRelocation;
+  std::map<long, long> blockRelocation;
+  
+  // The properties of the most recent tag, with its IDs relocated
+  properties relocated;
+  
+  public:
+  RelocatedStructureParser(common::structureParser& parser);
+  
+  // Reads the next tag, returning the type of the next tag read and the properties of the object it denotes
+  // with its IDs relocated
+  std::pair<properties::tagType, const properties*> next();
+  
+  protected:
+  // Returns whether the given key of the given level of a tag holds an anchor ID
+  static bool isAnchorKey(const std::string& level, const std::string& key);
+  
+  // Returns the new ID of the given ID in the given offset table, assigning it if the ID has not been seen before
+  static long relocate(std::map<long, long>& relocation, long ID);
+};
+
+// The maximum number of events in a batch handed over by PipelinedStructureParser's reader thread and the
+// maximum number of batches that it may read ahead of the consumer
+static const int pipelineBatchEvents = 4096;
+static const int pipelineWindow = 4;
+
+// Runs another parser on a separate reader thread, so that the log is read and tokenized while the events 
+// that were already read are being consumed (e.g. laid out by slayout). The events are handed over in batches
+// of pipelineBatchEvents events. If the log is still being written, batches can also be ended at every event
+// at the log's top level, so that the consumer receives each top-level block as soon as it is complete. 
+// The events are identical to those produced by the wrapped parser. Since the reader may be waiting for the
+// wrapped parser, the object may only be destroyed after all the events have been consumed.
+// This overlaps only the reading of the log with its consumption. The consumer still processes the events 
+// serially (slayout does not lay out file levels in parallel; see layoutPipelined()).
+class PipelinedStructureParser : public common::structureParser {
+  // The wrapped parser, which only the reader thread uses
+  common::structureParser& parser;
+  
+  // Records whether batches end at every event at the log's top level
+  bool topLevelBatches;
+  
+  pthread_t reader;
+  
+  // Protects all the fields below, which are shared with the reader
+  pthread_mutex_t mutex;
+  // Signaled when a batch has been read and when the consumer has finished with a batch, respectively
+  pthread_cond_t readCond;
+  pthread_cond_t consumedCond;
+  
+  // The batches that have been read but not yet consumed. Each event is a tagType byte followed by an image of 
+  // the tag's properties, written by properties::save().
+  std::list<std::string*> batches;
+  
+  // Records whether the reader has read the last batch
+  bool done;
+  
+  // The events of the batch currently being consumed and the position of the next event within them
+  std::string* curEvents;
+  const char* curEvent;
+  
+  // The properties of the last tag returned by next()
+  properties tagProperties;
+  
+  public:
+  // topLevelBatches: whether batches end at every event at the log's top level
+  PipelinedStructureParser(common::structureParser& parser, bool topLevelBatches=false);
+  ~PipelinedStructureParser();
+  
+  // Reads the next tag from the log, returning the type of the next tag read and the properties of 
+  // the object it denotes.
+  std::pair<properties::tagType, const properties*> next();
+  
+  protected:
+  // Entry point of the reader thread
+  static void* readerMain(void* arg);
 };
 
 } // namespace sight
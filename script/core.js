@@ -228,30 +228,103 @@ function mapHash_rec(subHT, UID, mapFunc, indent) {
  ***** File Management *****
  ***************************/
 
+// If the layout was generated with SIGHT_LAYOUT_PACK (the pages set packedLayout), the files of nested file
+// levels are stored in the segment files pack.<N> and pack.index maps the name of each one to its segment and
+// its offset and length within it.
+var packIndex;
+// Segments that were loaded in their entirety because the server ignored the requested byte range 
+var packSegments = {};
+
+// Calls continuationFunc() once the index of the packed files has been loaded
+function loadPackIndex(continuationFunc) {
+  if(typeof packIndex !== 'undefined') { continuationFunc(); return; }
+  loadFile('pack.index', function(text) {
+    packIndex = {};
+    var lines=text.split("\n");
+    for(var i=0; i<lines.length; i++) {
+      var fields = lines[i].split(" ");
+      if(fields.length==4) packIndex[fields[0]] = [fields[1], parseInt(fields[2]), parseInt(fields[3])];
+    }
+    continuationFunc();
+  });
+}
+
+// Calls continuationFunc() on the contents of the given file if it is stored in the packed output and
+// calls notPackedFunc() otherwise
+function loadPackedFile(url, continuationFunc, notPackedFunc) {
+  if(typeof packedLayout === 'undefined') { notPackedFunc(); return; }
+  loadPackIndex(function() {
+    if(!(url in packIndex)) { notPackedFunc(); return; }
+    var segment=packIndex[url][0], offset=packIndex[url][1], len=packIndex[url][2];
+    
+    function decode(buf, start) { return new TextDecoder().decode(new Uint8Array(buf, start, len)); }
+    if(segment in packSegments) { continuationFunc(decode(packSegments[segment], offset)); return; }
+    if(len==0) { continuationFunc(""); return; }
+    
+    var xhr= new XMLHttpRequest();
+    xhr.open('GET', 'pack.'+segment, true);
+    xhr.responseType = 'arraybuffer';
+    xhr.setRequestHeader('Range', 'bytes='+offset+'-'+(offset+len-1));
+    xhr.onreadystatechange= function() {
+      if (this.readyState!==4) return;
+      if(this.status==206) continuationFunc(decode(this.response, 0));
+      // The whole segment was returned (e.g. for file:// URLs), so keep it for the other files stored in it
+      else {
+        packSegments[segment] = this.response;
+        continuationFunc(decode(this.response, offset));
+      }
+    };
+    xhr.send();
+  });
+}
+
 var scriptEltID=0;
 function loadURLIntoDiv(doc, url, divName, continuationFunc) {
-  var xhr= new XMLHttpRequest();
-  xhr.open('GET', url, true);
-  xhr.onreadystatechange= function() {
-    //Wait until the data is fully loaded
-    if (this.readyState!==4) return;
+  function insert(text) {
     // Option 1:
-    //doc.getElementById(divName).innerHTML= this.responseText;
+    //doc.getElementById(divName).innerHTML= text;
     // Option 2:
     var scriptNode = document.createElement('script_'+scriptEltID);
     scriptEltID++;
-    scriptNode.innerHTML = this.responseText;
+    scriptNode.innerHTML = text;
     doc.getElementById(divName).appendChild(scriptNode);
           
     if(typeof continuationFunc !== 'undefined')
       continuationFunc();
-  };
-  xhr.send();
+  }
+  
+  loadPackedFile(url, insert, function() {
+    var xhr= new XMLHttpRequest();
+    xhr.open('GET', url, true);
+    xhr.onreadystatechange= function() {
+      //Wait until the data is fully loaded
+      if (this.readyState!==4) return;
+      insert(this.responseText);
+    };
+    xhr.send();
+  });
 }
   
 // From http://www.javascriptkit.com/javatutors/loadjavascriptcss.shtml
 //  and http://stackoverflow.com/questions/950087/how-to-include-a-javascript-file-in-another-javascript-file
 function loadjscssfile(filename, filetype, continuationFunc){
+  // Scripts stored in the packed output are added with their contents inline
+  if(filetype=="text/javascript") {
+    loadPackedFile(filename, 
+      function(text) {
+        var scriptNode=document.createElement('script');
+        scriptNode.setAttribute("type", filetype);
+        scriptNode.text = text;
+        document.getElementsByTagName("head")[0].appendChild(scriptNode);
+        if(typeof continuationFunc !== 'undefined') continuationFunc();
+      },
+      function() { linkjscssfile(filename, filetype, continuationFunc); });
+  } else
+    linkjscssfile(filename, filetype, continuationFunc);
+}
+
+// Adds a reference to the given script or CSS file to the document
+function linkjscssfile(filename, filetype, continuationFunc){
   if (filetype=="text/css"){ //if filename is an external CSS file
     var fileref=document.createElement("link")
     fileref.setAttribute("rel", "stylesheet")
@@ -395,6 +468,8 @@ function goToAnchor(prefix, suffix, continuationFunc) {
 }
 
 var hostname="";
+// The application's executable, which the layout sets once the structure log has provided it
+var sightExecFile="";
 /*  function findReachableHost(hosts) {
   for(var i=0; i<hosts.length; i++)
   {
@@ -11,6 +11,8 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
 #include <list>
 #include <string>
 #include <map>
@@ -19,6 +21,7 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <string.h>
 #include <assert.h>
 
 // Include all the definitions that control compilation
@@ -76,6 +79,66 @@ class printable
 // Call the print method of the given printable object
 //std::ofstream& operator<<(std::ofstream& ofs, const printable& p);
 
+// Growable array of plain-old-data elements, the first N of which are stored inside the object itself.
+// Used by properties to hold its contents without any heap allocations in the common case of small objects.
+template<typename T, int N>
+class smallBuf
+{
+  T  local[N];
+  T* data;
+  int num;
+  int cap;
+  
+  public:
+  smallBuf() : data(local), num(0), cap(N) {}
+  smallBuf(const smallBuf& that) : data(local), num(0), cap(N) { append(that.data, that.num); }
+  ~smallBuf() { if(data != local) free(data); }
+  
+  smallBuf& operator=(const smallBuf& that) {
+    if(this != &that) { num=0; append(that.data, that.num); }
+    return *this;
+  }
+  
+  int size() const { return num; }
+  T&       operator[](int i)       { return data[i]; }
+  const T& operator[](int i) const { return data[i]; }
+  const T* begin() const { return data; }
+  void clear() { num=0; }
+  
+  // Makes room for at least n more elements
+  void reserve(int n) {
+    if(num+n <= cap) return;
+    while(cap < num+n) cap *= 2;
+    if(data == local) {
+      data = (T*)malloc(sizeof(T)*cap);
+      memcpy(data, local, sizeof(T)*num);
+    } else
+      data = (T*)realloc(data, sizeof(T)*cap);
+  }
+  
+  void append(const T* src, int n) {
+    reserve(n);
+    memcpy(data+num, src, sizeof(T)*n);
+    num += n;
+  }
+  
+  void push_back(const T& v) { append(&v, 1); }
+  
+  // Inserts v at index i, shifting all the subsequent elements
+  void insert(int i, const T& v) {
+    reserve(1);
+    memmove(data+i+1, data+i, sizeof(T)*(num-i));
+    data[i] = v;
+    num++;
+  }
+  
+  // Removes the element at index i, shifting all the subsequent elements
+  void erase(int i) {
+    memmove(data+i, data+i+1, sizeof(T)*(num-i-1));
+    num--;
+  }
+}; // class smallBuf
+
 // Records the properties of a given object
 class properties
 {
@@ -83,11 +146,54 @@ class properties
   // Differentiates between the entry tag of an object and its exit tag
   typedef enum {enterTag, exitTag, unknownTag} tagType;
   
-  // Lists the mapping the name of a class in an inheritance hierarchy to its map of key-value pairs.
-  // Objects are ordered according to inheritance depth with the base class at the end of the 
-  // list and most derived class at the start.
-  std::list<std::pair<std::string, std::map<std::string, std::string> > > p;
+  private:
+  // The properties of an object are stored as a flat list of levels, one for each class in its inheritance 
+  // hierarchy, each of which refers to a contiguous range of key->value entries. Levels are ordered according 
+  // to inheritance depth with the base class at the end of the list and most derived class at the start. The 
+  // entries of each level are sorted by key. The names of the classes and the keys and values of the entries 
+  // are slices of a single character arena. All three arrays keep their first elements inside the properties 
+  // object, so building the properties of a typical tag requires no heap allocations beyond the object itself.
+  
+  // A range of characters within arena
+  struct slice {
+    int start, len;
+  };
+  
+  struct level {
+    slice name;
+    // The range of entries of this level
+    int firstEntry, numEntries;
+  };
+  
+  struct entry {
+    slice key;
+    slice val;
+  };
+  
+  smallBuf<level, 4>   levels;
+  smallBuf<entry, 16>  entries;
+  smallBuf<char, 512>  arena;
+  
+  // Appends the given characters to the arena and returns their slice
+  slice addToArena(const char* s, int len);
+  
+  // Returns the string held by the given slice
+  std::string sliceStr(const slice& s) const { return std::string(arena.begin()+s.start, s.len); }
+  
+  // Compares the string held by the given slice to the given characters, returning <0, 0 or >0
+  int sliceCmp(const slice& s, const char* t, int tLen) const;
   
+  // Returns the index of the entry in the given level with the given key or -1 if there is no such entry.
+  // If the key is not found and insertPos is non-NULL, sets it to the index where the key would be inserted.
+  int findEntry(int lvl, const char* key, int keyLen, int* insertPos=NULL) const;
+  
+  // Maps the given key to the given value in the given level, replacing its current value if any
+  void setEntry(int lvl, const char* key, int keyLen, const char* val, int valLen);
+  
+  // Compares the contents of this object to those of that, ignoring active and emitTag, returning <0, 0 or >0
+  int compare(const properties& that) const;
+  
+  public:
   // Records whether this object is active (true) or disabled (false)
   bool active;
   
@@ -97,58 +203,48 @@ class properties
   properties(): active(true), emitTag(true) {}
   // Creates properties where the object name objName is mapped to no properties
   properties(std::string objName): active(true), emitTag(true)  {
-    std::map<std::string, std::string> emptyMap;
-    add(objName, emptyMap);
+    add(objName);
   }
-  properties(const std::list<std::pair<std::string, std::map<std::string, std::string> > >& p, const bool& active, const bool& emitTag): p(p), active(active), emitTag(emitTag) {}
-  properties(const properties& that) : p(that.p), active(that.active), emitTag(that.emitTag) {}
+  properties(const properties& that) : levels(that.levels), entries(that.entries), arena(that.arena), active(that.active), emitTag(that.emitTag) {}
     
+  // Adds a new level for the given class with the given key->value mappings
   void add(std::string className, const std::map<std::string, std::string>& props);
   
+  // Adds a new level for the given class with no key->value mappings. Mappings can be added to it via addKey().
+  void add(const std::string& className);
+  void add(const char* className);
+  
+  // Adds the given key->value mapping to the most recently added level. The const char* variants let callers 
+  // pass string literals without constructing temporary strings.
+  void addKey(const std::string& key, const std::string& val);
+  void addKey(const std::string& key, long val);
+  void addKey(const char* key, const std::string& val);
+  void addKey(const char* key, long val);
+  
   bool operator==(const properties& that) const
-  { 
-    /*std::cout << "p==that.p = "<<(p==that.p)<<std::endl;
-      std::cout << "p.size()="<<p.size()<<", that.p.size()="<<that.p.size()<<std::endl;
-      std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator itThis = p.begin();
-      std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator itThat = that.p.begin();
-      for(; itThis!=p.end(); itThis++, itThat++) {
-        std::cout << "    itThis->first = "<<itThis->first<<" itThat->first="<<itThat->first<<std::endl;
-        std::cout << "    itThis->first==itThat->first = "<<(itThis->first==itThat->first)<<", itThis->second==itThat->second = "<<(itThis->second==itThat->second)<<std::endl;
-      }
-    std::cout << "active==that.active = "<<(active==that.active)<<std::endl;
-    std::cout << "emitTag==that.emitTag = "<<(emitTag==that.emitTag)<<std::endl;*/
-    return p==that.p && active==that.active && emitTag==that.emitTag; }
+  { return compare(that)==0 && active==that.active && emitTag==that.emitTag; }
 
   bool operator!=(const properties& that) const
   { return !(*this == that); }
   
   bool operator<(const properties& that) const
-  { return (p< that.p) ||
-           (p==that.p && active< that.active) ||
-           (p==that.p && active==that.active && emitTag< that.emitTag); }
-  
-  //typedef std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator iterator;
+  { int c = compare(that);
+    return (c<0) ||
+           (c==0 && active< that.active) ||
+           (c==0 && active==that.active && emitTag< that.emitTag); }
   
-  // Wrapper for iterators to property lists that includes its own end iterator to make it possible to 
-  // tell whether the iterator has reached the end of the list without having a reference to the list itself.
+  // Iterator over the levels of a properties object
   class iterator {
     friend class properties;
-    std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator cur;
-    std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator end;
+    const properties* props;
+    int cur;
     
     public:  
-    iterator(const std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator& cur,
-             const std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator& end) :
-        cur(cur), end(end)
-    {}
+    iterator() : props(NULL), cur(0) {}
     
-    iterator(const std::list<std::pair<std::string, std::map<std::string, std::string> > >& l) :
-      cur(l.begin()), end(l.end())
-    {}
+    iterator(const properties* props, int cur) : props(props), cur(cur) {}
     
-    iterator(const properties& props) :
-      cur(props.p.begin()), end(props.p.end())
-    {}
+    iterator(const properties& props) : props(&props), cur(0) {}
     
     // Returns the value mapped to the given key
     std::string get(std::string key) const;
@@ -171,44 +267,50 @@ class properties
     
     // Returns the iterator that follows this one without modifying this one
     iterator next() const {
-      std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator next = cur;
-      next++;
-      return iterator(next, end);
+      return iterator(props, cur+1);
     }
     
     // Returns the iterator that precedes this one without modifying this one
     iterator prev() const {
-      std::list<std::pair<std::string, std::map<std::string, std::string> > >::const_iterator prev = cur;
-      prev--;
-      return iterator(prev, end);
+      return iterator(props, cur-1);
     }
     
-    const std::pair<std::string, std::map<std::string, std::string> >& operator*() {
+    std::pair<std::string, std::map<std::string, std::string> > operator*() const {
       assert(!isEnd());
-      return *cur;
+      return std::make_pair(name(), getMap());
     }
     
     // Returns whether this iterator has reached the end of its list
     bool isEnd() const
-    { return cur == end; }
+    { return props==NULL || cur == props->levels.size(); }
     
     // Given an iterator to a particular key->value mapping, returns the number of keys in the map
     int getNumKeys() const
-    { return cur->second.size(); }
+    { return props->levels[cur].numEntries; }
+    
+    // Returns the key and the value of the ith key->value mapping at this iterator, in sorted key order, 
+    // as a pointer to its characters and their count
+    const char* keyData(int i) const { return props->arena.begin() + props->entries[props->levels[cur].firstEntry+i].key.start; }
+    int         keyLen (int i) const { return props->entries[props->levels[cur].firstEntry+i].key.len; }
+    const char* valData(int i) const { return props->arena.begin() + props->entries[props->levels[cur].firstEntry+i].val.start; }
+    int         valLen (int i) const { return props->entries[props->levels[cur].firstEntry+i].val.len; }
+    
+    // Returns the key and the value of the ith key->value mapping at this iterator, in sorted key order
+    std::string key(int i) const { return std::string(keyData(i), keyLen(i)); }
+    std::string val(int i) const { return std::string(valData(i), valLen(i)); }
       
-    // Given an iterator to a particular key->value mapping, returns a const reference to the key/value mapping
-    const std::map<std::string, std::string>& getMap() const
-    { return cur->second; }
+    // Given an iterator to a particular key->value mapping, returns a copy of the key/value mapping
+    std::map<std::string, std::string> getMap() const;
     
     public:
     
     // Returns whether the given key is mapped to a value in the key/value map at this iterator
     bool exists(std::string key) const
-    { return cur->second.find(key) != cur->second.end(); }
+    { return props->findEntry(cur, key.data(), key.length()) >= 0; }
     
     // Returns the name of the object type referred to by the given iterator
     std::string name() const
-    { return cur->first; }
+    { return props->sliceStr(props->levels[cur].name); }
     
     // Returns the string representation of the given properties iterator  
     std::string str() const;
@@ -232,6 +334,9 @@ class properties
   // Given the label of a particular key->value mapping, adds the given mapping to it
   void set(std::string name, std::string key, std::string value);
   
+  // Given the label of a particular key->value mapping, removes the given key from it, if it exists
+  void erase(std::string name, std::string key);
+  
   // Given an iterator to a particular key->value mapping, returns the integer interpretation of the value mapped to the given key
   static long getInt(iterator cur, std::string key);
   
@@ -244,18 +349,6 @@ class properties
   // Returns the floating-point interpretation of the given string
   static long asFloat(std::string val);
   
-  /* // Given an iterator to a particular key->value mapping, returns whether the given key is mapped to some value
-  static bool exists(iterator cur, std::string key);
-  
-  // Given an iterator to a particular key->value mapping, returns the number of keys in the map
-  static int getNumKeys(iterator cur);
-    
-  // Given an iterator to a particular key->value mapping, returns a const reference to the key/value mapping
-  static const std::map<std::string, std::string>& getMap(iterator cur);
-    
-  // Returns the name of the object type referred to by the given iterator
-  static std::string name(iterator cur);*/
-  
   // Returns the name of the most-derived class 
   std::string name() const;
   
@@ -265,6 +358,14 @@ class properties
   // Erases the contents of this object
   void clear();
   
+  // Appends to out a compact image of this object's contents, from which load() can restore it. Since the 
+  // levels, entries and arena are plain-old-data the image is just a copy of the three arrays.
+  void save(std::string& out) const;
+  
+  // Replaces the contents of this object with the image that starts at p, which was written by save(), and
+  // returns a pointer to the character that follows the image
+  const char* load(const char* p);
+  
   // Returns the string representation of the given properties iterator  
   static std::string str(iterator props);
   
@@ -336,8 +437,307 @@ class dbgStream : public std::ostream
 // Given a string, returns a version of the string with all the control characters that may appear in the
 // string escaped to that the string can be written out to Dbg::dbg with no formatting issues.
 // This function can be called on text that has already been escaped with no harm.
-std::string escape(std::string s);
-std::string unescape(std::string s);
+std::string escape(const std::string& s);
+std::string unescape(const std::string& s);
+
+// Returns a pointer to the first '[' or ']' character in the range [s, end) or end if there are none.
+// The scan examines 16 or 32 bytes at a time where SSE2 or AVX2 is available.
+const char* findBracket(const char* s, const char* end);
+
+// The maximum number of characters findAnyOf() can compare against in bulk
+static const int maxFindChars = 8;
+
+// Returns a pointer to the first character in the range [s, end) that is one of the numChars characters in chars,
+// or end if there are none. Sets of up to maxFindChars characters are scanned 16 or 32 bytes at a time where 
+// SSE2 or AVX2 is available.
+const char* findAnyOf(const char* s, const char* end, const char* chars, int numChars);
+
+// Support for the binary encoding of structure logs, which is emitted instead of the text encoding if the
+// SIGHT_BINARY_OUT environment variable is set. A binary log starts with the binaryLog::magic signature, which
+// is followed by a sequence of records. Each record starts with a single byte that identifies its type.
+// All integers are encoded as unsigned LEB128 varints and all strings as a varint length followed by the raw
+// bytes of the string, meaning that they never need to be escaped. Tag names and property keys are written
+// once into a dictionary and are referred to by their IDs in all subsequent records.
+namespace binaryLog {
+  // The signature at the start of every binary log. It starts with a NUL character, which never appears at
+  // the start of a text log.
+  extern const char magic[];
+  extern const int magicLen;
+
+  typedef enum {
+    // varint ID, string name: Maps the next dictionary ID to the given tag name or property key. IDs are
+    //    assigned densely, starting from 0, in the order in which they are defined.
+    defName=1,
+    // varint numLevels, then for each level of the object's derivation hierarchy (most derived first):
+    //    varint nameID, varint numProps, numProps x (varint keyID, string value)
+    enterTag=2,
+    // varint nameID
+    exitTag=3,
+    // string text: Text emitted by the application between tags
+    text=4
+  } recordType;
+
+  // Appends the varint encoding of v to s
+  void appendVarint(std::string& s, unsigned long v);
+
+  // Appends the length-prefixed encoding of str to s
+  void appendString(std::string& s, const std::string& str);
+} // namespace binaryLog
+
+// Support for compressed structure logs, which are emitted when the SIGHT_COMPRESS environment variable is set.
+// A compressed log starts with the compressedLog::magic signature, which is followed by a sequence of frames.
+// Each frame holds a contiguous region of the uncompressed log that starts and ends at tag boundaries, so that
+// the log can be parsed starting at any frame. A frame is encoded as its 4-byte compressed size, its 4-byte
+// uncompressed size and its contents, compressed using the LZ4 block format. The frames are terminated by a
+// frame header with compressed size 0, which is followed by the frame index: the 4-byte number of frames and,
+// for each frame, the 8-byte offset of its header within the file, the 8-byte offset of its contents within the
+// uncompressed log and the 4-byte nesting depth of the log's tags at the frame's start. The file ends with the
+// 8-byte offset of the index and the compressedLog::indexMagic signature. All integers are little-endian.
+namespace compressedLog {
+  // The signature at the start of every compressed log. It starts with a NUL character, which never appears at
+  // the start of a text log, and differs from the binary log signature.
+  extern const char magic[];
+  extern const int magicLen;
+
+  // The signature at the end of every complete compressed log
+  extern const char indexMagic[];
+  extern const int indexMagicLen;
+
+  // Size of a frame header and of each entry in the frame index, in bytes
+  static const int frameHeaderLen = 8;
+  static const int indexEntryLen = 20;
+
+  // Compresses the n bytes at src, appending the result to out
+  void compress(const char* src, size_t n, std::string& out);
+
+  // Decompresses the n bytes at src, which must hold a block produced by compress(), appending the result to
+  // out. rawLen is the size of the uncompressed data. Returns true on success and false if the block is corrupt.
+  bool decompress(const char* src, size_t n, size_t rawLen, std::string& out);
+
+  // Appends the little-endian encoding of v to s using the given number of bytes
+  void appendInt(std::string& s, unsigned long v, int numBytes);
+
+  // Decodes the little-endian integer of the given number of bytes at s
+  unsigned long readInt(const char* s, int numBytes);
+
+  // An entry in the frame index
+  class indexEntry {
+    public:
+    // Offset of the frame's header within the compressed file
+    unsigned long fileOffset;
+    // Offset of the frame's contents within the uncompressed log
+    unsigned long rawOffset;
+    // The nesting depth of the tags in the log at the start of the frame
+    int depth;
+
+    indexEntry(unsigned long fileOffset, unsigned long rawOffset, int depth) :
+      fileOffset(fileOffset), rawOffset(rawOffset), depth(depth) {}
+  };
+
+  // Reads the frame index at the end of the compressed log f into index. Returns true on success and false
+  // if f does not end with an index (e.g. because the application that wrote it was killed). The read
+  // position of f is left unspecified.
+  bool readIndex(FILE* f, std::vector<indexEntry>& index);
+} // namespace compressedLog
+
+// Support for the side-car index of a structure file, which makes it possible to read the subtree of the log
+// rooted at a given block without parsing the whole file. The index is written next to the structure file
+// (in structure.idx) by dbgStream when the SIGHT_INDEX environment variable is set or built afterwards by the
+// sindex tool. It holds one entry for every block (including scopes and other objects derived from blocks),
+// which records the offsets of the block's entry tag and of the end of its exit tag within the log, its nesting
+// depth (the number of tags that enclose it, including the sight tag), the name of its tag and its label, 
+// block ID and anchor ID. It also holds an entry for every call path definition (callPathDef tag), which has
+// no label or IDs, so that a reader that starts at a block can load the call paths that the block's subtree
+// refers to by reading just their definitions rather than the whole log before the block. Offsets are counted in the uncompressed text of the log, which is also how they are
+// recorded in the frame index of compressed logs. The index is a text file that starts with the 
+// structIndex::header line, which is followed by one line per entry in the format
+//   offset exitOffset depth tagName blockID anchorID label
+// where the label is escaped. Entries are listed in the order in which the blocks were exited.
+namespace structIndex {
+  // The first line of every index file
+  extern const char header[];
+  
+  // An entry in the index
+  class entry {
+    public:
+    // Offset of the block's entry tag within the log and the offset that immediately follows its exit tag
+    unsigned long offset;
+    unsigned long exitOffset;
+    // The number of tags that enclose the block
+    int depth;
+    // The name of the block's tag (e.g. "block" or "scope")
+    std::string name;
+    // The block's label, ID and anchor ID. The IDs are -1 if the block has none.
+    std::string label;
+    long ID;
+    long anchorID;
+    
+    entry() : offset(0), exitOffset(0), depth(0), ID(-1), anchorID(-1) {}
+  };
+  
+  // Returns the path of the index of the structure file at the given path
+  std::string indexFName(std::string structFName);
+  
+  // If the object with the given properties is a block or a call path definition, sets the name, label and IDs
+  // of e to describe it and returns true. Returns false otherwise.
+  bool describe(const properties& props, entry& e);
+  
+  // Writes the line that encodes the given entry to out
+  void write(std::ostream& out, const entry& e);
+  
+  // Reads the index in the given file into entries, sorted by offset. Returns true on success and false if the 
+  // file does not exist or is not an index.
+  bool read(std::string fName, std::vector<entry>& entries);
+  
+  // Returns the entry of the block with the given ID or anchor ID, or NULL if there is none
+  const entry* findBlock(const std::vector<entry>& entries, long ID);
+  const entry* findAnchor(const std::vector<entry>& entries, long anchorID);
+} // namespace structIndex
+
+// Header of the shared-memory segment through which the structure log is passed from the application to the
+// layout process when the SIGHT_SHM_OUT environment variable is set. The header is followed by a ring buffer
+// of capacity bytes, which the application (producer) writes to and the layout process (consumer) reads from
+// in place. Each side only sleeps when the ring is full or empty, respectively, and the other side only makes
+// a system call to wake it up when it has announced that it is sleeping.
+class shmRing {
+  public:
+  // The number of bytes in the ring buffer
+  unsigned long capacity;
+
+  // The process IDs of the application and the layout process (0 until it attaches to the segment), which
+  // make it possible for each side to notice if the other died. If the layout process does not attach within
+  // attachTimeoutMS, the application sets consumerPID to abandoned and no longer writes to the ring.
+  int producerPID;
+  volatile int consumerPID;
+  static const int abandoned = -1;
+  static const int attachTimeoutMS = 10000;
+
+  // The total number of bytes that have been written into the ring and that have been consumed from it.
+  // These counters grow monotonically and the corresponding offsets within the ring are their values
+  // modulo capacity. consumed <= written <= consumed+capacity.
+  volatile unsigned long written;
+  volatile unsigned long consumed;
+
+  // Set once the application has finished writing the structure log
+  volatile int closed;
+
+  // Words that the consumer and producer sleep on while the ring is empty and full, respectively, and the
+  // flags through which they announce that they are sleeping. The words are incremented to wake the sleepers.
+  volatile int dataSeq;
+  volatile int spaceSeq;
+  volatile int consumerWaiting;
+  volatile int producerWaiting;
+
+  // Returns the number of bytes needed for the segment of a ring with the given capacity
+  static size_t segmentSize(unsigned long capacity) { return sizeof(shmRing) + capacity; }
+
+  // Returns a pointer to the ring buffer that follows the header
+  char* data() { return ((char*)this) + sizeof(shmRing); }
+
+  // Initializes the header of a newly-created segment
+  void init(unsigned long capacity);
+
+  // Called by the producer after it advances written
+  void dataAvailable();
+
+  // Called by the consumer after it advances consumed
+  void spaceAvailable();
+
+  // Blocks the consumer until at least minBytes have been written but not consumed, or the ring is closed.
+  // Returns the number of such bytes, which may be smaller than minBytes if the ring is closed. If the
+  // producer dies without closing the ring, marks it as closed.
+  unsigned long waitForData(unsigned long minBytes);
+
+  // Blocks the producer until there is free space in the ring and returns the number of free bytes. Returns 0
+  // if the consumer died or did not attach within attachTimeoutMS, in which case consumerPID is abandoned.
+  unsigned long waitForSpace();
+
+  private:
+  // Blocks the caller until *seq differs from val, timeoutMS milliseconds pass or a spurious wakeup occurs
+  static void sleep(volatile int* seq, int val, int timeoutMS);
+
+  // Wakes up all the processes sleeping on *seq
+  static void wake(volatile int* seq);
+}; // class shmRing
+
+// Counters of the cost of Sight's own work, which make it possible to tell how much of an application's execution 
+// time is due to Sight. They are collected when the SIGHT_OVERHEAD environment variable is set and are reported
+// in a sightOverhead tag at the end of the main dbgStream. If SIGHT_OVERHEAD=stderr, a summary is also printed
+// to stderr when Sight shuts down. Each thread updates its own counters, which are only aggregated when they
+// are reported. Since the report covers all the threads of the process, per-thread streams do not emit it.
+namespace overhead {
+  // The code regions whose execution time is measured
+  typedef enum {enterStrTime, exitStrTime, escapeTime, stackwalkTime, attrQueryTime, traceEmitTime, bufWriteTime, 
+                numTimers} timerT;
+  
+  // The names of the timers, indexed by timerT
+  extern const char* timerNames[];
+  
+  // Records whether the counters are collected
+  extern bool enabled;
+  
+  // The counters of a single thread
+  class counters {
+    public:
+    // The total nanoseconds spent in each timed region and the number of times it was entered
+    unsigned long long ns[numTimers];
+    unsigned long calls[numTimers];
+    
+    // The number of bytes emitted for each type of tag and the number of objects created of each widget class
+    std::map<std::string, unsigned long> bytes;
+    std::map<std::string, unsigned long> objects;
+    
+    counters();
+    
+    // Adds the given counters to these
+    void add(const counters& that);
+  };
+  
+  // Returns the counters of the calling thread
+  counters& local();
+  
+  // Returns the sum of the counters of all the threads
+  counters total();
+  
+  // Returns the current time in nanoseconds
+  inline unsigned long long now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ULL + t.tv_nsec;
+  }
+  
+  // Measures the time between its construction and destruction and adds it to the given timer
+  class timer {
+    timerT t;
+    unsigned long long start;
+    public:
+    timer(timerT t) : t(t), start(enabled? now(): 0) {}
+    ~timer() {
+      if(start==0) return;
+      counters& c = local();
+      c.ns[t] += now()-start;
+      c.calls[t]++;
+    }
+  };
+  
+  // Records that the given number of bytes were emitted for the tag with the given properties or for the 
+  // type of tag with the given name. The name is only looked up if the counters are collected, so that
+  // emission does not build a string and search a map for every tag when they are not.
+  inline void addBytes(const properties& props, unsigned long n)
+  { if(enabled) local().bytes[props.name()] += n; }
+  inline void addBytes(const char* tagName, unsigned long n)
+  { if(enabled) local().bytes[tagName] += n; }
+  
+  // Records the creation of the object with the given properties, whose name is its widget class
+  inline void addObject(const properties& props)
+  { if(enabled) local().objects[props.name()]++; }
+  
+  // Returns the total counters as key->value mappings for the sightOverhead tag
+  std::map<std::string, std::string> report();
+  
+  // If SIGHT_OVERHEAD=stderr, prints a summary of the total counters to stderr
+  void printSummary();
+} // namespace overhead
 
 // Wrapper for strings in which some characters have been escaped. This is useful for serializing multi-level 
 // collection objects, while using the same separator for each level of the encoding.
@@ -412,6 +812,7 @@ class escapedStr {
 
 class structureParser {
   public:
+  virtual ~structureParser() {}
  
   // Reads more data from the data source, returning the type of the next tag read and the properties of 
   // the object it denotes.
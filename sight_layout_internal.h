@@ -68,6 +68,41 @@ void  defaultExitHandler(void* obj);
 // Given a parser that reads the structure of a given log file, lays it out and prints it to the output Sight stream
 void layoutStructure(common::structureParser& parser);
 
+// If true, layoutStructure() flushes the output files whenever a top-level block of the log is exited, so that
+// the layout of a log that is still being written can be viewed as it grows (slayout --follow)
+extern bool flushTopLevelBlocks;
+
+// Cache of layouts in the directory named by SIGHT_LAYOUT_CACHE, which lets slayout reuse the output of an
+// earlier layout of the same log, or of the same subtree of a log, by the same slayout build and settings rather
+// than regenerating it. Each entry is a directory named after the entry's key that holds a copy of the html
+// directory and index.html file that the layout created in its working directory, as well as the time it took
+// to generate them. Whole logs are keyed by the contents of the structure file and subtrees (slayout --subtree
+// and --anchor, which sserve runs for each block it shows) by their events, with their anchor and block IDs
+// relocated. The file stats in the cache directory counts the lookups, hits and seconds saved over the cache's
+// lifetime and the file hashes records the hashes of the files that were hashed, so that they are only 
+// rehashed if they change.
+namespace layoutCache {
+  // Returns the key of the layout of the given structure file, which combines a hash of the file's contents with 
+  // toolKey(). The hash of the file is only recomputed if the file has changed since it was last hashed.
+  std::string key(std::string cacheDir, std::string structureFName);
+  
+  // Returns the key of the layout of the events read by the given parser, which combines a hash of the events 
+  // with toolKey(). Subtrees of a log are keyed by reading them with a SubtreeStructureParser wrapped in a 
+  // RelocatedStructureParser, so that a subtree's key does not depend on where it is in the log or on the IDs of
+  // its anchors and blocks, and the subtree is laid out from the same relocated events.
+  std::string eventsKey(std::string cacheDir, common::structureParser& parser);
+  
+  // If the cache holds the layout with the given key, copies it into workDir, sets savedSecs to the time it 
+  // took to generate and returns true. Returns false otherwise.
+  bool restore(std::string cacheDir, std::string key, std::string workDir, double& savedSecs);
+  
+  // Adds the layout in workDir to the cache under the given key, recording that it took layoutSecs to generate
+  void store(std::string cacheDir, std::string key, std::string workDir, double layoutSecs);
+  
+  // Records the outcome of a lookup in the cache's statistics and prints them
+  void report(std::string cacheDir, bool hit, double savedSecs);
+} // namespace layoutCache
+
 }
 }
 
@@ -94,6 +129,106 @@ void* SightInit(properties::iterator props);
 class dbgStream;
 typedef std::list<std::pair<int, std::list<int> > > location;
 
+// Encodes loc as a packed path: the number of file levels, then for each level its file index, the number of
+// block indexes within it and the block indexes themselves, all as zigzag-encoded varints. The encoding is
+// self-delimiting and two locations are equal if and only if their packed paths are equal.
+void packLocation(const location& loc, std::string& packed);
+
+// Decodes the packed path that starts at p into loc and returns a pointer to the byte after it
+const char* unpackLocation(const char* p, location& loc);
+
+// The default number of bytes of packed locations beyond which an anchorArena moves them to a memory-mapped
+// file. 0 means that arenas are never spilled. Overridden by the SIGHT_ANCHOR_SPILL environment variable.
+static const unsigned long anchorSpillBytes = 0;
+
+// Append-only storage for packed locations. Each location is stored as its varint length followed by its packed
+// path and is referred to by its offset within the arena, which remains valid as the arena grows. The arena is
+// kept in memory until it grows beyond the spill threshold, at which point it is moved to an unlinked temporary
+// file that is memory-mapped, so that the operating system can page the locations out under memory pressure.
+class anchorArena {
+  char* data;
+  unsigned long len;
+  unsigned long cap;
+
+  // The spill threshold and the descriptor of the spill file, or -1 if the arena is still in memory
+  unsigned long spillBytes;
+  int spillFD;
+
+  public:
+  anchorArena();
+  ~anchorArena();
+
+  // Appends the given packed location and returns its offset
+  unsigned long append(const std::string& packed);
+
+  // Returns the packed location at the given offset and sets packedLen to its length
+  const char* get(unsigned long offset, unsigned long& packedLen) const;
+
+  unsigned long size() const { return len; }
+  bool spilled() const { return spillFD>=0; }
+
+  protected:
+  // Makes room for at least need more bytes, spilling the arena to a file if it has grown beyond spillBytes
+  void reserve(unsigned long need);
+
+  // Moves the arena to a memory-mapped file of the given capacity
+  void spill(unsigned long newCap);
+}; // class anchorArena
+
+// The minimum number of entries an anchorTable buffers before merging them into its sorted arrays, and the
+// fraction of the arrays' size that the buffers may grow to beyond that
+static const int anchorBufferMin = 1024;
+static const int anchorBufferFraction = 16;
+
+// The two global anchor tables: the location of each located anchor ID and the first anchor ID that was
+// located at each location. std::maps of locations cost hundreds of bytes per anchor, so instead the locations
+// are packed into an anchorArena and each table keeps its entries in an array that is sorted by key and holds
+// only the keys and arena offsets. Since anchors are not located in ID or location order, new entries are first
+// buffered in small std::maps, which are merged into the sorted arrays once they grow beyond a fraction of the
+// arrays' size. All lookups are binary searches of the arrays and the buffers and take O(log n) time.
+class anchorTable {
+  anchorArena arena;
+
+  // Sorted array of (anchor ID, arena offset of its location) pairs and the buffer of recent updates to it
+  std::vector<std::pair<int, unsigned long> > locsByID;
+  std::map<int, unsigned long> recentLocs;
+
+  // Array of (arena offset of a location, anchor ID) pairs, sorted by the packed locations at the offsets, and
+  // the buffer of recent insertions into it, which maps packed locations to their (anchor ID, arena offset) pairs
+  std::vector<std::pair<unsigned long, int> > idsByLoc;
+  std::map<std::string, std::pair<int, unsigned long> > recentIDs;
+
+  // The most recently stored packed location and its arena offset
+  std::pair<std::string, unsigned long> lastStored;
+
+  public:
+  // Returns whether the location of the given anchor ID is known and if so, sets loc to it
+  bool findLoc(int anchorID, location& loc) const;
+
+  // Records loc as the location of the given anchor ID, replacing any prior location
+  void setLoc(int anchorID, const location& loc);
+
+  // Returns the ID of the first anchor that was located at loc. If no anchor has been located there,
+  // records anchorID as that anchor and returns it.
+  int firstIDAt(const location& loc, int anchorID);
+
+  protected:
+  // Adds the given packed location to the arena and returns its offset. Since a location is usually recorded
+  // by setLoc() and then immediately by firstIDAt(), the most recently stored location is not stored again.
+  unsigned long store(const std::string& packed);
+
+  // Compares the packed location at the given arena offset to the given packed location, returning a negative
+  // number, 0 or a positive number if it is respectively less than, equal to or greater than it
+  int comparePacked(unsigned long offset, const std::string& packed) const;
+
+  // Returns the index within idsByLoc of the entry for the given packed location or -1 if there is none
+  long findPacked(const std::string& packed) const;
+
+  // Merge the buffers into the sorted arrays if they have grown large enough
+  void mergeLocs();
+  void mergeIDs();
+}; // class anchorTable
+
 // Uniquely identifies a location with the debug information, including the file and region hierarchy
 // Anchors can be created in two ways:
 // - When their host output locations are reached. In this case the anchor's full file and region location is available
@@ -119,15 +254,14 @@ class anchor
   // Associates each anchor with its location (if known). Useful for connecting anchor objects with started out
   // unlocated (e.g. forward links) and then were located when we reached their target. Since there may be multiple
   // copies of the original unlocated anchor running around, these copies won't be automatically updated. However,
-  // this map will always keep the latest information.
+  // this table will always keep the latest information.
   // Note: an alternative design would use smart pointers, since it would remove the need for keeping copies of anchors
   //       around since no anchor would ever go out of scope. However, a dependence on boost or C++11 seems too much to add.
-  static std::map<int, location> anchorLocs;
-  
-  // Associates each anchor with a unique anchor ID. Useful for connecting multiple anchors that were created
-  // independently but then ended up referring to the same location. We'll record the ID of the first one to reach
-  // this location on locAnchorIDs and the others will be able to adjust themselves by adopting this ID.
-  static std::map<location, int> locAnchorIDs;
+  // The table also associates each location with a unique anchor ID. Useful for connecting multiple anchors that were
+  // created independently but then ended up referring to the same location. We'll record the ID of the first one to
+  // reach this location and the others will be able to adjust themselves by adopting this ID.
+  // The table is returned by a function so that it is constructed before any static anchor objects use it.
+  static anchorTable& table();
   
   // The debug stream this anchor is associated with
   //dbgStream& myDbg;
@@ -155,7 +289,7 @@ class anchor
   void setLocated(bool located) { this->located = located; }
   
   protected:
-  // If this anchor is unlocated, checks anchorLocs to see if a location has been found and updates this
+  // If this anchor is unlocated, checks the anchor table to see if a location has been found and updates this
   // object accordingly.
   void update();
   
@@ -215,6 +349,10 @@ class block
   // to discrete points in the original application's execution, such as for launching GDB to run upto a 
   // particular point in the app's execution
   int blockIDFromStructure;
+  
+  // The number of instances of this block's label that were elided by the structure layer's sampling policy 
+  // between the previous emitted instance and this one
+  long numElided;
     
   // Counts the number of times the block constructor has been called
   static int blockCount;
@@ -236,6 +374,7 @@ class block
   void setLocation(const location& loc);
   std::string getFileID() const { return fileID; }
   std::string getBlockID() const { return blockID; }
+  long getNumElided() const { return numElided; }
   
   protected:
   anchor& getAnchorRef();
@@ -351,10 +490,55 @@ protected:
 }; // class dbgBuf
 
 
+// The size in bytes beyond which packedOutput starts a new segment file
+static const unsigned long packSegmentSize = 64*1024*1024;
+
+// Stores the files of the nested file levels of a packed layout (SIGHT_LAYOUT_PACK) in a few large segment 
+// files rather than creating each of them separately. A file is accumulated in memory while it is open and 
+// appended to the current segment, html/pack.<N>, when it is closed. html/pack.index holds a line for every 
+// file with its name relative to html/, its segment and its offset and length within the segment, which 
+// script/core.js uses to load the file.
+class packedOutput {
+  // The directory that holds the segments and the index
+  std::string htmlDir;
+  
+  // The current segment, its number and the number of bytes written to it
+  std::ofstream segment;
+  int segmentIdx;
+  unsigned long segmentSize;
+  
+  std::ofstream index;
+  
+  // Maps the streams of the files that are currently open to their names relative to htmlDir
+  std::map<std::ofstream*, std::string> openFiles;
+  
+  public:
+  packedOutput();
+  
+  // Records whether init() has been called
+  bool enabled() const { return htmlDir!=""; }
+  
+  void init(std::string htmlDir);
+  
+  // Returns a stream for writing the file with the given name relative to htmlDir
+  std::ofstream& createFile(std::string relName);
+  
+  // Returns whether the given stream was created by createFile() and has not yet been closed
+  bool holds(std::ofstream* f) const { return openFiles.find(f)!=openFiles.end(); }
+  
+  // Appends the contents of the given stream, which was created by createFile(), to the current segment
+  void closeFile(std::ofstream* f);
+  
+  // Flushes the segment and the index
+  void flush();
+  
+  // Closes the segment and the index
+  void close();
+}; // packedOutput
+
 // Stream that uses dbgBuf
 class dbgStream : public common::dbgStream
 {
-  std::list<std::ofstream*> indexFiles;
   std::list<std::ofstream*> dbgFiles;
   std::list<std::string>    detailFileRelFNames; // Relative names of all the dbg files on the stack
   std::list<std::ofstream*> summaryFiles;
@@ -372,6 +556,8 @@ class dbgStream : public common::dbgStream
   int                       anchorsPerScriptFile;
   // Keeps track of the anchor script files that have been created so far
   std::set<int>             createdAnchorFiles;
+  // Holds the files of the nested file levels if the layout is packed
+  packedOutput              pack;
   public:
   int getAnchorsPerScriptFile() const { return anchorsPerScriptFile; }
   private:
@@ -400,6 +586,9 @@ public:
   void init(std::string title, std::string workDir, std::string imgDir, std::string tmpDir);
   ~dbgStream();
   
+  // Completes the output files of the layout. The destructor calls it if it has not already been called.
+  void finish();
+  
   // Switch between the owner class and user code writing text into this stream
   void userAccessing();
   void ownerAccessing();
@@ -411,6 +600,10 @@ public:
   // commands in the script file are executed
   std::ofstream* getCurScriptPrologFile() const;
   std::ofstream* getCurScriptEpilogFile() const;
+  
+  // Flushes the text written so far into all the files that are currently open, so that the output can be
+  // viewed while the log is still being laid out
+  void flushFiles();
 
   // Return the root working directory
   const std::string& getWorkDir() const { return workDir; }
@@ -475,12 +668,21 @@ public:
   
   // Exit a current file level
   block* exitFileLevel(bool topLevel=false);
+  
+  // Creates the file with the given name relative to workDir/html for the current file level. If the layout 
+  // is packed and the file level is nested, the file is stored in the packed output.
+  std::ofstream& createLevelFile(std::string relName);
+  
+  // Closes a file that was created by createLevelFile()
+  void closeLevelFile(std::ofstream* f);
     
   // Record the mapping from the given anchor ID to the given string in the global script file
   void writeToAnchorScript(int anchorID, const location& myLoc);
 
-  void printSummaryFileContainerHTML(std::string absoluteFileName, std::string relativeFileName, std::string title);
-  void printDetailFileContainerHTML(std::string absoluteFileName, std::string title);
+  // Writes the html container of the summary file with the given name relative to workDir/html
+  void printSummaryFileContainerHTML(std::string relativeFileName, std::string title);
+  // Writes the html container of the detail file with the given name relative to workDir/html
+  void printDetailFileContainerHTML(std::string relativeFileName, std::string title);
   
   // Called when a block is entered.
   // b: The block that is being entered
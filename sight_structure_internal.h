@@ -20,7 +20,11 @@
 #include <ostream>
 #include <fstream>
 #include <stdarg.h>
+#include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <semaphore.h>
 #include "sight_common.h"
 #include "utils.h"
 #include "tools/callpath/include/Callpath.h"
@@ -44,6 +48,13 @@ extern char username[10000];
 // The unique ID of this process' output stream
 extern int outputStreamID;
 
+// Records whether the metadata about the application's execution that is expensive to capture is collected in
+// the background and emitted in a sightMeta tag at the end of each dbgStream (SIGHT_FAST_INIT)
+extern bool metaDeferred;
+
+// Returns the deferred metadata, waiting for the thread that collects it to finish if needed
+const std::map<std::string, std::string>& getDeferredMeta();
+
 extern bool initializedDebug;
 
 class dbgStream;
@@ -364,7 +375,7 @@ class sightObj {
   // The stack of sightObjs that are currently in scope. We declare it as a static inside this function
   // to make it possible to ensure that the global soStack is constructed before it is used and therefore
   // destructed after all of its user objects are destructed.
-  // There is a separate stack for each outgoing stream.
+  // There is a separate stack for each outgoing stream within each thread.
   //static std::map<dbgStream*, std::list<sightObj*> > staticSoStack;
   // The stack of sightObjs that are currently in scope
   //static std::list<sightObj*> soStack;
@@ -378,9 +389,9 @@ class sightObj {
   /*static std::list<sightObj*>& soStack(dbgStream* outStream);
   static std::map<dbgStream*, std::list<sightObj*> >& soStackAllStreams();*/
   
-  // If outStream is not specified it defaults to structure::dbg. This default is
-  // is implemented in sight_structure.C because structure::dbg must be declared 
-  // below the declaration of the sighObj class.
+  // If outStream is not specified it defaults to threadDbg(), which is structure::dbg on the thread that 
+  // initialized Sight. This default is implemented in sight_structure.C because structure::dbg must be 
+  // declared below the declaration of the sighObj class.
   sightObj(dbgStream* outStream=NULL);
   // isTag - if true, we emit a single enter/exit tag combo in the constructor and nothing in the destructor
   sightObj(properties* props, bool isTag=false, dbgStream* outStream=NULL);
@@ -411,6 +422,9 @@ class sightObj {
 
   // Destroys all the currently live sightObjs on the stack
   static void destroyAll();
+  
+  // Returns whether Sight has begun the process of destroying all objects
+  static bool inSightDestruction() { return SightDestruction; }
     
   // Returns whether this object is active or not
   bool isActive() const;
@@ -694,7 +708,7 @@ class Merger {
                        std::map<std::string, streamRecord*>& inStreamRecords, MergeInfo& info);
     
   // Given a vector of tag properties, returns whether the given key exists in all tags
-  bool keyExists(const std::vector<std::pair<properties::tagType, properties::iterator> >& tags, std::string key);
+  static bool keyExists(const std::vector<std::pair<properties::tagType, properties::iterator> >& tags, std::string key);
   
   // Given a vector of tag properties, returns the vector of values assigned to the given key within the given tag
   static std::vector<std::string> getValues(const std::vector<std::pair<properties::tagType, properties::iterator> >& tags, 
@@ -818,12 +832,14 @@ class anchor
   // This map maintains the canonical anchor ID for each location. Other anchors are resynched to used this ID 
   // whenever they are copied. This means that data structures that index based on anchors may need to be 
   // reconstructed after we're sure that their targets have been reached to force all anchors to use their canonical IDs.
-  static std::map<int, location> anchorLocs;
+  // Since locations are specific to the dbgStream of each thread, there is a separate map for each thread.
+  static std::map<int, location>& anchorLocs();
 
   // Associates each anchor with a unique anchor ID. Useful for connecting multiple anchors that were created
   // independently but then ended up referring to the same location. We'll record the ID of the first one to reach
   // this location on locAnchorIDs and the others will be able to adjust themselves by adopting this ID.
-  static std::map<location, int> locAnchorIDs;
+  // There is a separate map for each thread.
+  static std::map<location, int>& locAnchorIDs();
 
   // Itentifies this anchor's location in the file and region hierarchies
   location loc;
@@ -985,6 +1001,94 @@ class streamAnchor: public printable
   std::string str(std::string indent="") const;
 }; // class streamAnchor
 
+/*
+Sampling policies bound the number of instances of a given block, scope or trace observation that are written
+to the structure file. They are specified in the configuration file (SIGHT_STRUCTURE_CONFIG or SIGHT_CONFIG)
+via sample tags, each of which selects the policy of the blocks, scopes and trace observations with a given label:
+  [sample label="solve" policy="oneInN" n="100"][/sample]
+    Emits one out of every n instances
+  [sample label="iter" policy="tokenBucket" rate="10" burst="50"][/sample]
+    Emits up to rate instances per second on average, with bursts of up to burst instances
+  [sample label="step" policy="firstK" k="20"][/sample]
+    Emits the first k instances and then backs off exponentially, emitting instances k+1, k+2, k+4, k+8, ...
+The policy is applied separately at each call site that creates objects with its label, which is identified by
+the ID that dbgStream::callPathID() assigns to the call path of the object's creation. A suppressed block or scope 
+emits neither its entry nor its exit tag, and all the text and objects inside it are suppressed as well, which 
+keeps the nesting of the remaining tags valid. The next instance from the same call site that is emitted records
+in its elided property the number of instances skipped there since the previous emitted one. Instances skipped
+after the last emitted one at each call site are recorded in sampleElided tags when Sight shuts down.
+*/
+class samplePolicy : public common::Configuration {
+  public:
+  typedef enum {oneInN, tokenBucket, firstK} policyT;
+  
+  private:
+  std::string label;
+  policyT policy;
+  
+  // oneInN: the sampling period
+  long n;
+  // tokenBucket: the number of tokens added per second and the maximum number of tokens in the bucket
+  double rate;
+  double burst;
+  // firstK: the number of instances emitted before the policy starts backing off
+  long k;
+  
+  // The state of the policy at a single call site
+  class siteState {
+    public:
+    // The number of instances observed so far
+    long count;
+    // The number of instances skipped since the most recent emitted instance
+    long skipped;
+    
+    // The state of the token bucket, protected by bucketLock
+    double tokens;
+    double lastRefill;
+    int bucketLock;
+    
+    siteState(double tokens, double lastRefill) : count(0), skipped(0), tokens(tokens), lastRefill(lastRefill), bucketLock(0) {}
+  };
+  
+  // Maps the call path IDs of the call sites at which objects with this label have been created to the 
+  // policy's state at each one, protected by sitesMutex
+  std::map<int, siteState*> sites;
+  pthread_mutex_t sitesMutex;
+  
+  // Maps labels to the policies that apply to them. It is filled in while the configuration file is loaded
+  // and is read-only afterwards, which makes it possible to look up policies without locking.
+  static std::map<std::string, samplePolicy*>& policies();
+  
+  samplePolicy(properties::iterator props);
+  
+  // Returns the state of this policy at the call site with the given call path ID, creating it if needed
+  siteState* site(int callSite);
+  
+  public:
+  // Configuration handler for sample tags
+  static common::Configuration* configure(properties::iterator props);
+  
+  // Returns the policy that applies to objects with the given label or NULL if they are not sampled
+  static samplePolicy* get(const std::string& label);
+  
+  // Decides whether the next instance created at the call site with the given call path ID should be emitted. 
+  // If so, returns true and sets elided to the number of instances skipped at this call site since the previous
+  // emitted one. Otherwise, returns false. May be called concurrently from multiple threads.
+  bool admit(int callSite, long& elided);
+  
+  // Emits a sampleElided tag for every call site at which a policy has skipped instances since its most recent
+  // emitted one
+  static void emitElided();
+  
+  std::string str() const;
+}; // class samplePolicy
+
+class samplingConfHandlerInstantiator : common::confHandlerInstantiator {
+  public:
+  samplingConfHandlerInstantiator();
+};
+extern samplingConfHandlerInstantiator samplingConfHandlerInstance;
+
 // A block out debug output, which may be filled by various visual elements
 class block : public sightObj
 {
@@ -996,6 +1100,27 @@ class block : public sightObj
   // maxBlockID also counts the number of times that the block constructor was called, which makes it possible
   // to set conditional breakpoints to run a debugger to the entry into a specific block in the debug output.
   static int maxBlockID;
+  // The ID that setProperties() most recently reserved on the calling thread for the block it is setting up.
+  // maxBlockID is shared by all threads, so each block's ID is reserved atomically before its tag is emitted
+  // and then adopted by advanceBlockID().
+  static __thread int reservedBlockID;
+  
+  // Records whether this block was suppressed by its sampling policy. As with reservedBlockID, setProperties()
+  // makes this decision on the calling thread before the block is constructed and records it in 
+  // reservedSampledOut.
+  bool sampledOut;
+  static __thread bool reservedSampledOut;
+  
+  // Applies the sampling policy of the given label, if any, to a block that is about to be emitted with the
+  // given properties. Returns the number of instances skipped at the block's call site since the previous 
+  // emitted one if the block will be emitted and 0 otherwise. If the policy identified the call site, sets 
+  // callSite to its call path ID and otherwise to -1.
+  static long applySampling(const std::string& label, properties* props, int& callSite);
+  
+  // Adopts the sampling decision that setProperties() made for this block. A suppressed block emits no tags but
+  // is still placed on the stack of open objects, so that if Sight shuts down while it is open, destroyAll() 
+  // destroys it, ending the suppression, after the objects inside it and before the objects that enclose it.
+  void adoptSampling();
   
   // The anchor that denotes the starting point of this scope
   anchor startA;
@@ -1095,6 +1220,510 @@ class BlockStreamRecord: public streamRecord {
 
 // Adapted from http://wordaligned.org/articles/cpp-streambufs
 // A extension of stream that corresponds to a single file produced by sight
+// Stream buffer that decouples the application from the stream buffer that its structure log is ultimately
+// written to (the pipe to the layout process or the structure file). Each write is appended to an in-memory
+// ring buffer, which may be written to concurrently by multiple threads without taking a lock, and a dedicated
+// writer thread drains the ring buffer into the base stream buffer. Each write is appended as a unit, meaning 
+// that the bytes of a single tag are never interleaved with those of other writes or partially dropped.
+// asyncOutBufs are created by dbgStream when the SIGHT_ASYNC_OUT environment variable is set and are configured 
+// via the following environment variables:
+// SIGHT_ASYNC_BUFFER_SIZE - the capacity of the ring buffer in bytes (default 16MB)
+// SIGHT_ASYNC_FULL - what the application does when the ring buffer is full:
+//    block (default) - wait for the writer thread to make space in the ring buffer
+//    drop - discard the write and count the number of discarded bytes, which are reported when the buffer is closed
+//    spill - append the write to a spill file in the working directory, which the writer thread drains after 
+//            the ring buffer
+// The number of milliseconds that close() waits for writes that have reserved space in the ring buffer to be
+// committed. A thread that crashed while writing never commits its write, so after this time only the data that
+// has been committed is written out.
+static const int asyncCloseWaitMS = 1000;
+
+class asyncOutBuf : public std::streambuf
+{
+  public:
+  typedef enum {blockWhenFull, dropWhenFull, spillWhenFull} fullPolicy;
+  
+  private:
+  // The stream buffer that the writer thread writes to
+  std::streambuf* baseBuf;
+  
+  // The ring buffer and its capacity in bytes
+  char* ring;
+  unsigned long capacity;
+  
+  // The total number of bytes that have been reserved by writes, that have been fully copied into the ring by
+  // writes, and that have been drained from the ring by the writer thread. These counters grow monotonically
+  // and the corresponding offsets within ring are their values modulo capacity. 
+  // drained <= committed <= reserved <= drained+capacity, where reserved excludes spillingFlag.
+  // Under the spillWhenFull policy, spillingFlag is set in reserved while writes are being spilled. Since it
+  // is set by the same atomic operation that reserves ring space, every write either reserved its space in the
+  // ring before spilling began or is appended to the spill file.
+  volatile unsigned long reserved;
+  volatile unsigned long committed;
+  volatile unsigned long drained;
+  
+  fullPolicy policy;
+  
+  // The number of bytes discarded because the ring buffer was full, under the dropWhenFull policy
+  volatile unsigned long numDropped;
+  
+  // Under the spillWhenFull policy, the file that writes that don't fit into the ring buffer are appended to.
+  // While spillingFlag is set in reserved all writes are appended to the spill file to keep them in order.
+  std::string spillFName;
+  FILE* spillFile;
+  static const unsigned long spillingFlag = 1UL << (sizeof(unsigned long)*8-1);
+  // Protects spillFile and the setting and clearing of spillingFlag
+  pthread_mutex_t spillMutex;
+  
+  // The writer thread
+  pthread_t writer;
+  // Set to tell the writer thread to exit once it has drained all the data
+  volatile bool stopping;
+  // Records whether close() has been called
+  bool closed;
+  
+  // All the currently open asyncOutBufs, to make it possible to flush them all via closeAll()
+  static std::list<asyncOutBuf*> allBufs;
+  static pthread_mutex_t allBufsMutex;
+  
+  public:
+  asyncOutBuf(std::streambuf* baseBuf, unsigned long capacity, fullPolicy policy, std::string spillFName);
+  ~asyncOutBuf();
+  
+  // If SIGHT_ASYNC_OUT is set, returns a new asyncOutBuf that writes to baseBuf, configured according
+  // to the environment. Otherwise, returns NULL.
+  // workDir: the directory into which the spill file will be written
+  static asyncOutBuf* create(std::streambuf* baseBuf, std::string workDir);
+  
+  // Waits until all the data written to this buffer has been written to baseBuf and stops the writer thread.
+  // No more data may be written to this buffer after it is closed.
+  void close();
+  
+  // Closes all currently open asyncOutBufs. Called when Sight shuts down, including when the application crashes.
+  static void closeAll();
+  
+  protected:
+  virtual int overflow(int c);
+  virtual std::streamsize xsputn(const char* s, std::streamsize n);
+  
+  // Syncing is the writer thread's responsibility, so the application does not wait for it
+  virtual int sync() { return 0; }
+  
+  private:
+  // Appends the given data to the ring buffer as a unit, applying the full-buffer policy if it does not fit.
+  // n must be no larger than capacity.
+  void append(const char* s, unsigned long n);
+  
+  // Writes all the data committed to the ring buffer to baseBuf and returns the number of bytes written
+  unsigned long drainRing();
+  
+  // Returns whether writes are currently being spilled
+  bool spilling() const { return (reserved & spillingFlag) != 0; }
+  
+  // If all the writes that reserved space in the ring buffer before spilling began have been drained, writes the
+  // contents of the spill file to baseBuf and ends spilling. If force is true, does so even if some of those writes
+  // have not been committed.
+  void drainSpill(bool force=false);
+  
+  // The body of the writer thread
+  static void* writerThread(void* arg);
+}; // class asyncOutBuf
+
+// Stream buffer that compresses the structure log before writing it to a base stream buffer, using the
+// compressedLog format. compressedOutBufs are created by dbgStream when both SIGHT_FILE_OUT and SIGHT_COMPRESS
+// are set, with SIGHT_COMPRESS optionally specifying the approximate number of uncompressed bytes in each
+// frame (default 1MB). Frames end only at tag boundaries and never between the tags that encode the levels
+// of a single object's entry, meaning that the log can be parsed starting at the beginning of any frame.
+// The frame index is written when the buffer is closed. Compression supports only the text encoding of the
+// structure log.
+class compressedOutBuf : public std::streambuf
+{
+  // The stream buffer that compressed frames are written to
+  std::streambuf* baseBuf;
+
+  // The approximate number of uncompressed bytes in each frame
+  unsigned long frameSize;
+
+  // The log text that has not yet been compressed into a frame
+  std::string pending;
+
+  // The number of bytes written to baseBuf and the number of uncompressed bytes in all the frames written so far
+  unsigned long fileOffset;
+  unsigned long rawOffset;
+
+  // The tag nesting depth at the start of pending
+  int pendingDepth;
+
+  // The offset within pending of the last tag boundary observed and the tag nesting depth at it.
+  // lastBoundary is 0 if pending contains no boundary at which a frame may end.
+  unsigned long lastBoundary;
+  int boundaryDepth;
+
+  // State of the scan that identifies tag boundaries, which persists across writes
+  // The current tag nesting depth
+  int depth;
+  // Whether the scan is currently inside a tag
+  bool inTag;
+  // Whether the last character scanned was the '[' that starts a tag
+  bool atTagStart;
+  // Whether the tag currently being scanned, or the last tag if the scan is outside a tag, is one of the
+  // non-final levels of an object's entry
+  bool derivedLevel;
+
+  // The index entries of all the frames written so far
+  std::vector<common::compressedLog::indexEntry> index;
+
+  // Protects all of the above
+  pthread_mutex_t mutex;
+
+  // Records whether close() has been called
+  bool closed;
+
+  // All the currently open compressedOutBufs, to make it possible to close them all via closeAll()
+  static std::list<compressedOutBuf*> allBufs;
+  static pthread_mutex_t allBufsMutex;
+
+  public:
+  compressedOutBuf(std::streambuf* baseBuf, unsigned long frameSize);
+  ~compressedOutBuf();
+
+  // If SIGHT_COMPRESS is set, returns a new compressedOutBuf that writes to baseBuf, configured according
+  // to the environment. Otherwise, returns NULL.
+  static compressedOutBuf* create(std::streambuf* baseBuf);
+
+  // Compresses all the data written to this buffer and writes the frame index, completing the file.
+  // No more data may be written to this buffer after it is closed.
+  void close();
+
+  // Closes all currently open compressedOutBufs. Called when Sight shuts down, including when the application crashes.
+  static void closeAll();
+
+  protected:
+  virtual int overflow(int c);
+  virtual std::streamsize xsputn(const char* s, std::streamsize n);
+
+  // Data is only written to baseBuf in whole frames, so syncing does not force any out
+  virtual int sync() { return 0; }
+
+  private:
+  // Scans the n bytes that were just appended to pending, starting at offset start, updating the tag
+  // boundary state
+  void scan(unsigned long start, unsigned long n);
+
+  // Compresses the first n bytes of pending into a frame, writes it to baseBuf and removes them from pending.
+  // endDepth is the tag nesting depth at the end of the frame.
+  void writeFrame(unsigned long n, int endDepth);
+}; // class compressedOutBuf
+
+// Stream buffer that hands the structure log to the layout process through a common::shmRing in a shared memory
+// segment rather than through a pipe, so that writing a tag does not require a system call and the layout
+// process parses the log directly out of the segment. The producer and consumer only wake each other up when
+// the other side is sleeping on an empty or full ring. shmOutBufs are created by dbgStream when it pipes the
+// structure log to the layout process and SIGHT_SHM_OUT is set, optionally to the capacity of the ring in
+// bytes (default 16MB). The segment is unlinked as soon as it is created and the layout process inherits its
+// file descriptor, whose number is passed to it in the SIGHT_SHM_IN environment variable. If the layout process
+// does not attach before the ring fills up and common::shmRing::attachTimeoutMS passes, the log is written to
+// the structure file in the working directory instead.
+class shmOutBuf : public std::streambuf
+{
+  // The ring in the shared segment and the number of bytes mapped for it
+  common::shmRing* ring;
+  size_t segmentSize;
+
+  // The file descriptor of the shared segment
+  int fd;
+
+  // Protects the producer side of the ring
+  pthread_mutex_t mutex;
+
+  // Records whether close() has been called
+  bool closed;
+
+  // The file that the structure log is written to if the layout process never attaches to the ring 
+  // (NULL unless it is in use)
+  std::string spillFName;
+  FILE* spillFile;
+
+  // Records whether the layout process is gone, after which the ring is no longer written to
+  bool layoutGone;
+
+  // All the currently open shmOutBufs, to make it possible to close them all via closeAll()
+  static std::list<shmOutBuf*> allBufs;
+  static pthread_mutex_t allBufsMutex;
+
+  public:
+  shmOutBuf(common::shmRing* ring, size_t segmentSize, int fd, std::string spillFName);
+  ~shmOutBuf();
+
+  // If SIGHT_SHM_OUT is set, creates a shared segment, makes its file descriptor inheritable and records it in
+  // SIGHT_SHM_IN so that the layout process that is launched next can attach to it, and returns a new 
+  // shmOutBuf that writes to it. Otherwise, returns NULL. The caller must call launched() once the layout 
+  // process has been started. If the layout process never attaches, the log is written to spillFName.
+  static shmOutBuf* create(std::string spillFName);
+
+  // Called once the layout process has been started to keep the segment from leaking to any other processes
+  void launched();
+
+  // Marks the end of the structure log, after which the layout process finishes reading it.
+  // No more data may be written to this buffer after it is closed.
+  void close();
+
+  // Closes all currently open shmOutBufs. Called when Sight shuts down, including when the application crashes.
+  static void closeAll();
+
+  protected:
+  virtual int overflow(int c);
+  virtual std::streamsize xsputn(const char* s, std::streamsize n);
+
+  // Data becomes visible to the layout process as soon as it is written, so there is nothing to sync
+  virtual int sync() { return 0; }
+
+  private:
+  // Called when the ring reports that the layout process did not attach in time or died. In the former case
+  // the whole log is still in the ring, so it is moved to spillFName, where the rest of the log is written.
+  // In the latter case the rest of the log is dropped.
+  void abandonLayout();
+}; // class shmOutBuf
+
+// Stream buffer that writes the structure file through a memory mapping rather than through an ofstream.
+// The file is preallocated in large chunks, each of which is mapped in turn, and the log is copied directly
+// into the mapping. When the buffer is closed, including when the application crashes, the file is truncated
+// to the length of the log. If the application is killed before it can do so, the file holds the log 
+// followed by the zero-filled remainder of the last chunk, which FILEStructureParser ignores.
+// mmapOutBufs are created by dbgStream when both SIGHT_FILE_OUT and SIGHT_MMAP_OUT are set, with SIGHT_MMAP_OUT
+// optionally specifying the number of bytes in each chunk (default 64MB).
+class mmapOutBuf : public std::streambuf
+{
+  // The name and descriptor of the file
+  std::string fName;
+  int fd;
+
+  // The number of bytes in each chunk, which is a multiple of the page size
+  unsigned long chunkSize;
+
+  // The mapping of the current chunk, the offset of the chunk within the file and the number of bytes 
+  // written to it so far
+  char* chunk;
+  unsigned long chunkOffset;
+  unsigned long chunkUsed;
+
+  // Protects all of the above
+  pthread_mutex_t mutex;
+
+  // Records whether close() has been called
+  bool closed;
+
+  // All the currently open mmapOutBufs, to make it possible to close them all via closeAll()
+  static std::list<mmapOutBuf*> allBufs;
+  static pthread_mutex_t allBufsMutex;
+
+  public:
+  mmapOutBuf(std::string fName, unsigned long chunkSize);
+  ~mmapOutBuf();
+
+  // If SIGHT_MMAP_OUT is set, returns a new mmapOutBuf that writes to the given file, configured according
+  // to the environment. Otherwise, returns NULL.
+  static mmapOutBuf* create(std::string fName);
+
+  // Unmaps the current chunk and truncates the file to the length of the log.
+  // No more data may be written to this buffer after it is closed.
+  void close();
+
+  // Closes all currently open mmapOutBufs. Called when Sight shuts down, including when the application crashes.
+  static void closeAll();
+
+  protected:
+  virtual int overflow(int c);
+  virtual std::streamsize xsputn(const char* s, std::streamsize n);
+
+  // Asks the kernel to start writing the data written so far back to the file
+  virtual int sync();
+
+  private:
+  // Unmaps the current chunk, if any, and allocates and maps the chunk at the given offset within the file
+  void mapChunk(unsigned long offset);
+}; // class mmapOutBuf
+
+// In flight-recorder mode (SIGHT_FLIGHT_RECORDER=<bytes>) the structure log is not written out as it is 
+// generated. Instead, the most recent part of it is kept in a fixed-size in-memory ring buffer, which is written
+// out as a well-formed structure file (workDir/structure) when Sight shuts down, when the application receives
+// a fatal signal or when the user sends it SIGUSR1. Text is evicted from the ring in whole tags. Since the
+// start of the log is eventually overwritten, the recorder keeps the entry tags of all the objects that were 
+// still open when their entry was evicted, as well as the evicted call path definitions, and emits them at the
+// start of each dump. The exit tags of the objects that are still open at the time of the dump are emitted 
+// at its end. The flight recorder supports only the text encoding of the structure log.
+// Dumps triggered by fatal signals run inside the signal handler and are therefore async-signal-safe: they 
+// do not allocate memory or block, and write to a file descriptor opened when the recorder is created.
+// Dumps requested via SIGUSR1 are performed by a dedicated thread that the signal handler wakes up.
+
+// The length of the shortest entry tag in the text encoding ([x numProperties="0"]), which bounds the 
+// number of entry tags that can be in a flight recorder's ring at once
+static const int minEntryTagLen = 21;
+
+class flightRecorderBuf : public std::streambuf
+{
+  // The ring buffer, its capacity, the offset of the oldest byte in it and the number of bytes it holds
+  char* ring;
+  unsigned long capacity;
+  unsigned long head;
+  unsigned long size;
+  
+  // The entry tags of the objects that were open when their entries were evicted, from outermost to innermost
+  std::list<std::string> evictedOpen;
+  
+  // The evicted callPathDef tags, which must precede any references to their call paths
+  std::string evictedDefs;
+  
+  // The file the ring is written to and its descriptor
+  std::string fName;
+  int fd;
+  
+  // Scratch space for dump(), allocated in advance so that dumps do not allocate memory: the offsets within
+  // the ring of the entry tags of the objects that are open at the current point in the dump
+  unsigned int* openRing;
+  unsigned long maxOpenRing;
+  
+  // Protects all the above state
+  pthread_mutex_t mutex;
+  
+  // Records whether close() has been called
+  bool closed;
+  
+  // All the currently open flightRecorderBufs, to make it possible to dump them all via dumpAll()
+  static std::list<flightRecorderBuf*> allBufs;
+  static pthread_mutex_t allBufsMutex;
+  
+  public:
+  flightRecorderBuf(unsigned long capacity, std::string fName);
+  ~flightRecorderBuf();
+  
+  // If SIGHT_FLIGHT_RECORDER is set, returns a new flightRecorderBuf that is dumped into the given working 
+  // directory. Otherwise, returns NULL.
+  static flightRecorderBuf* create(std::string workDir);
+  
+  // Writes the current contents of the ring to the output file as a well-formed structure log.
+  // If force is true, does so even if another thread is currently writing to this buffer, which is 
+  // necessary when the application has crashed while holding the lock. Forced dumps are performed inside
+  // signal handlers, so this function neither allocates memory nor blocks.
+  void dump(bool force=false);
+  
+  // Dumps this buffer one final time. No more data may be written to this buffer after it is closed.
+  void close();
+  
+  // Dumps all the currently open flightRecorderBufs
+  static void dumpAll(bool force=false);
+  
+  protected:
+  virtual int overflow(int c);
+  virtual std::streamsize xsputn(const char* s, std::streamsize n);
+  virtual int sync() { return 0; }
+  
+  private:
+  // Returns the character at the given offset from the start of the ring's contents
+  char at(unsigned long i) const { return ring[(head+i) % capacity]; }
+  
+  // Accessors that make it possible to parse units of the structure log both within the ring and within strings
+  class ringText {
+    const flightRecorderBuf* b;
+    public:
+    ringText(const flightRecorderBuf* b) : b(b) {}
+    char operator[](unsigned long i) const { return b->at(i); }
+  };
+  class strText {
+    const char* s;
+    public:
+    strText(const char* s) : s(s) {}
+    char operator[](unsigned long i) const { return s[i]; }
+  };
+  
+  // Returns the number of bytes in the unit at the given offset within text of length len: a complete
+  // entry tag (including all the levels of its inheritance hierarchy), an exit tag or a run of text
+  template<typename textT>
+  static unsigned long unitLen(const textT& text, unsigned long start, unsigned long len) {
+    unsigned long i=start;
+    if(text[i] != '[') {
+      while(i<len && text[i]!='[') i++;
+    } else if(i+1<len && text[i+1]=='/') {
+      while(i<len && text[i]!=']') i++;
+      if(i<len) i++;
+    } else {
+      // Entry tags consist of zero or more [|...] levels followed by the final [...] level
+      while(i<len) {
+        bool last = !(i+1<len && text[i+1]=='|');
+        while(i<len && text[i]!=']') i++;
+        if(i<len) i++;
+        if(last || i>=len || text[i]!='[') break;
+      }
+    }
+    return i-start;
+  }
+  
+  // Copies len bytes starting at the given offset from the start of the ring's contents into a string
+  std::string copyOut(unsigned long start, unsigned long len) const;
+  
+  // Removes the oldest unit from the ring and records it via recordEvicted()
+  void evictUnit();
+  
+  // Records the given evicted unit if it is the entry tag of an object that may still be open or a call path
+  // definition, or forgets the innermost evicted entry tag if it is an exit tag
+  void recordEvicted(const std::string& unit);
+  
+  // Returns the name of the object whose entry or exit tag starts at the given position in the given string
+  static std::string tagName(const std::string& s, unsigned long pos);
+  
+  // Sets nameStart and nameLen to the range of the name of the object whose entry or exit tag starts at the 
+  // given position in the given text of length len
+  template<typename textT>
+  static void nameRange(const textT& text, unsigned long pos, unsigned long len, unsigned long& nameStart, unsigned long& nameLen) {
+    pos++;
+    if(pos<len && (text[pos]=='/' || text[pos]=='|')) pos++;
+    nameStart = pos;
+    while(pos<len && text[pos]!=' ' && text[pos]!=']') pos++;
+    nameLen = pos-nameStart;
+  }
+  
+  // Returns whether the tags that start at the given positions within the given texts belong to the same object
+  template<typename textAT, typename textBT>
+  static bool sameName(const textAT& a, unsigned long aPos, unsigned long aLen, 
+                       const textBT& b, unsigned long bPos, unsigned long bLen) {
+    unsigned long aStart, aNameLen, bStart, bNameLen;
+    nameRange(a, aPos, aLen, aStart, aNameLen);
+    nameRange(b, bPos, bLen, bStart, bNameLen);
+    if(aNameLen != bNameLen) return false;
+    for(unsigned long i=0; i<aNameLen; i++)
+      if(a[aStart+i] != b[bStart+i]) return false;
+    return true;
+  }
+  
+  // Accumulates the text of a dump in a fixed-size buffer and writes it to a file descriptor with write(2)
+  class dumpWriter {
+    int fd;
+    char buf[4096];
+    unsigned long len;
+    public:
+    dumpWriter(int fd) : fd(fd), len(0) {}
+    ~dumpWriter() { flush(); }
+    void put(char c) { if(len==sizeof(buf)) flush(); buf[len++] = c; }
+    void put(const char* s, unsigned long n) { for(unsigned long i=0; i<n; i++) put(s[i]); }
+    void put(const char* s) { while(*s) put(*s++); }
+    template<typename textT>
+    void put(const textT& text, unsigned long start, unsigned long n) { for(unsigned long i=0; i<n; i++) put(text[start+i]); }
+    void flush();
+  };
+  
+  // Handlers of fatal signals and SIGUSR1
+  static void fatalSignal(int signum);
+  static void dumpSignal(int signum);
+  static struct sigaction origActions[NSIG];
+  
+  // Posted by the SIGUSR1 handler to wake up the thread that dumps all the flight recorders
+  static sem_t dumpRequests;
+  static void* dumperThread(void* arg);
+  
+  // Installs the signal handlers. Called when the first flightRecorderBuf is created.
+  static void installSignalHandlers();
+}; // class flightRecorderBuf
+
 class dbgBuf: public std::streambuf
 {
   friend class dbgStream;
@@ -1109,6 +1738,14 @@ class dbgBuf: public std::streambuf
   //      numOpenAngles > 1 implies an error or text inside a comment
   int numOpenAngles;
   
+  // True if the owner dbgStream uses the binary encoding of the structure log. In this case user text is
+  // wrapped in binaryLog::text records rather than escaped.
+  bool binaryOut;
+  
+  // The number of bytes written to baseBuf so far, which is the offset within the structure log of the next
+  // byte to be written
+  unsigned long bytesOut;
+  
   public:
   int getNumOpenAngles() const { return numOpenAngles; }
 
@@ -1179,6 +1816,74 @@ public:
   
   bool initialized;
   
+  // If the structure log is written asynchronously (SIGHT_ASYNC_OUT), the buffer that decouples buf from
+  // its destination. NULL otherwise.
+  asyncOutBuf* asyncBuf;
+  
+  // If the structure file is written through a memory mapping (SIGHT_MMAP_OUT), the buffer that writes it.
+  // NULL otherwise.
+  mmapOutBuf* mmapBuf;
+  
+  // If the structure file is compressed (SIGHT_COMPRESS), the buffer that compresses it. NULL otherwise.
+  compressedOutBuf* compressBuf;
+  
+  // If the structure log is handed to the layout process through shared memory (SIGHT_SHM_OUT), the buffer
+  // that writes to it. NULL otherwise.
+  shmOutBuf* shmBuf;
+  
+  // If the structure log is kept in a flight recorder (SIGHT_FLIGHT_RECORDER), the buffer that holds it.
+  // NULL otherwise.
+  flightRecorderBuf* flightBuf;
+  
+  // Records whether the structure log is written in the binary encoding (SIGHT_BINARY_OUT)
+  bool binaryOut;
+  
+  // If the blocks in the structure file are indexed as they are emitted (SIGHT_INDEX), the file the index is 
+  // written to. NULL otherwise.
+  std::ofstream* indexFile;
+  
+  // The number of tags that have been emitted to the structure log and not yet exited
+  int indexDepth;
+  
+  // The index entries of the blocks that have been entered but not yet exited, from outermost to innermost
+  std::vector<common::structIndex::entry> openIndexed;
+  
+  // Records in the index that the tag of the object with the given properties was emitted at the given offset
+  void indexEnter(const properties& props, unsigned long offset);
+  
+  // Records in the index that the innermost open tag was exited, its exit tag ending at the current offset
+  void indexExit();
+  
+  // Records in the index that a call path definition was emitted between the given offsets
+  void indexCallPathDef(unsigned long offset, unsigned long end);
+  
+  // Records whether the sight tag of this stream deferred the metadata that is expensive to capture, which 
+  // must then be emitted in a sightMeta tag at the end of the stream
+  bool deferMeta;
+  
+  // If binaryOut, maps each tag name and property key that has already been written to the binary
+  // dictionary to its ID
+  std::map<std::string, unsigned long> binaryDict;
+  
+  // Returns the ID of the given tag name or property key within the binary dictionary. If this is its first
+  // use, assigns it a fresh ID and appends its definition record to defs.
+  unsigned long binaryNameID(const std::string& name, std::string& defs);
+  
+  // Records for each call path ID whether its callPathDef tag has been emitted to this stream
+  std::vector<bool> definedCallPaths;
+  
+  // If call paths are sampled (SIGHT_CALLPATH_SAMPLE), maps the return addresses of each call site to the 
+  // number of times it has been reached and the ID of the call path observed the last time it was walked
+  std::map<std::vector<void*>, std::pair<int, int> > callSites;
+  
+  // Returns the process-wide ID of the current call path
+  int callPathID();
+  
+  // If the tag with the given properties refers to a call path that has not yet been defined in this stream,
+  // records it as defined and returns the text of the callPathDef tag that maps its ID to its string 
+  // representation. Otherwise returns "".
+  std::string callPathDefStr(const properties& props);
+  
 public:
   // Construct an ostream which tees output to the supplied
   // ostreams.
@@ -1186,6 +1891,13 @@ public:
   dbgStream(properties* props, std::string title, std::string workDir, std::string imgDir, std::string tmpDir);
   void init(properties* props, std::string title, std::string workDir, std::string imgDir, std::string tmpDir);
   ~dbgStream();
+  
+  private:
+  // Launches the layout process with the given command and returns the stream buffer through which the
+  // structure log is written to it
+  std::streambuf* startLayout(std::string cmd);
+  
+  public:
 
   // Directly calls the destructor of this object. This is necessary because when an application crashes
   // Sight must clean up its state by calling the destructors of all the currently-active sightObjs. Since 
@@ -1225,6 +1937,12 @@ public:
   // Adds an image to the output with the given extension and returns the path of this image
   // so that the caller can write to it.
   std::string addImage(std::string ext=".gif");
+  
+  // Records the current call path in the most recently added level of props as a reference to a call path.
+  // Whichever stream emits the tag defines the call path before it, and the structure parser replaces the 
+  // reference with the call path itself. If the caller has already computed the ID of the current call path,
+  // it may pass it as callPath to avoid walking the stack again.
+  void addCallPath(properties& props, int callPath=-1);
     
   // ----- Output of tags ----
   // Emit the entry into a tag to the structured output file. The tag is set to the given property key/value pairs
@@ -1259,6 +1977,13 @@ public:
 
 extern dbgStream dbg;
 
+// Returns the dbgStream that the calling thread should emit its output to. On the thread that initialized 
+// Sight (and on all threads before Sight is initialized) this is dbg. Every other thread gets its own 
+// dbgStream the first time it calls threadDbg(), which writes its log into the thread_<N> sub-directory 
+// of dbg's working directory. The per-thread logs can then be combined with hier_merge. The thread's 
+// dbgStream is closed when the thread exits.
+dbgStream& threadDbg();
+
 class dbgStreamMerger : public Merger {
   public:
   // The directory into which the merged will be written. This directory must be explicitly set before
@@ -1285,8 +2010,62 @@ class dbgStreamMerger : public Merger {
                        std::map<std::string, streamRecord*>& inStreamRecords, MergeInfo& info) { 
     Merger::mergeKey(type, tag.next(), inStreamRecords, info);
   }
+  
+  // Merges the details of the application's execution that are needed to re-execute it (its executable, 
+  // environment, host and user) across the given sight or sightMeta tags into pMap. Each detail is merged 
+  // only if it is present in the tags. Returns false if any detail is inconsistent across the tags.
+  static bool mergeExecInfo(const std::vector<std::pair<properties::tagType, properties::iterator> >& tags,
+                            std::map<std::string, std::string>& pMap);
 };
 
+// Merges the sightMeta tags that carry the execution metadata of streams whose sight tags deferred it
+class SightMetaMerger : public Merger {
+  public:
+  SightMetaMerger(std::vector<std::pair<properties::tagType, properties::iterator> > tags,
+                  std::map<std::string, streamRecord*>& outStreamRecords,
+                  std::vector<std::map<std::string, streamRecord*> >& inStreamRecords,
+                  properties* props=NULL);
+  
+  static Merger* create(const std::vector<std::pair<properties::tagType, properties::iterator> >& tags,
+                        std::map<std::string, streamRecord*>& outStreamRecords,
+                        std::vector<std::map<std::string, streamRecord*> >& inStreamRecords,
+                        properties* props)
+  { return new SightMetaMerger(tags, outStreamRecords, inStreamRecords, props); }
+  
+  // Sets a list of strings that denotes a unique ID according to which instances of this merger's 
+  // tags should be differentiated for purposes of merging. Tags with different IDs will not be merged.
+  // Each level of the inheritance hierarchy may add zero or more elements to the given list and 
+  // call their parents so they can add any info. Keys from base classes must precede keys from derived classes.
+  static void mergeKey(properties::tagType type, properties::iterator tag, 
+                       std::map<std::string, streamRecord*>& inStreamRecords, MergeInfo& info) { 
+    Merger::mergeKey(type, tag.next(), inStreamRecords, info);
+  }
+}; // class SightMetaMerger
+
+// Merges the sightOverhead tags that report the cost of Sight's own work in each process by summing their counters
+class SightOverheadMerger : public Merger {
+  public:
+  SightOverheadMerger(std::vector<std::pair<properties::tagType, properties::iterator> > tags,
+                      std::map<std::string, streamRecord*>& outStreamRecords,
+                      std::vector<std::map<std::string, streamRecord*> >& inStreamRecords,
+                      properties* props=NULL);
+  
+  static Merger* create(const std::vector<std::pair<properties::tagType, properties::iterator> >& tags,
+                        std::map<std::string, streamRecord*>& outStreamRecords,
+                        std::vector<std::map<std::string, streamRecord*> >& inStreamRecords,
+                        properties* props)
+  { return new SightOverheadMerger(tags, outStreamRecords, inStreamRecords, props); }
+  
+  // Sets a list of strings that denotes a unique ID according to which instances of this merger's 
+  // tags should be differentiated for purposes of merging. Tags with different IDs will not be merged.
+  // Each level of the inheritance hierarchy may add zero or more elements to the given list and 
+  // call their parents so they can add any info. Keys from base classes must precede keys from derived classes.
+  static void mergeKey(properties::tagType type, properties::iterator tag, 
+                       std::map<std::string, streamRecord*>& inStreamRecords, MergeInfo& info) { 
+    Merger::mergeKey(type, tag.next(), inStreamRecords, info);
+  }
+}; // class SightOverheadMerger
+
 class dbgStreamStreamRecord: public streamRecord {
   friend class dbgStreamMerger;
   // The current location within the debug output
@@ -1380,6 +2159,27 @@ class IndentMerger : public Merger {
   }
 }; // class IndentMerger
 
+class SampleElidedMerger : public Merger {
+  public:
+  SampleElidedMerger(std::vector<std::pair<properties::tagType, properties::iterator> > tags,
+                     std::map<std::string, streamRecord*>& outStreamRecords,
+                     std::vector<std::map<std::string, streamRecord*> >& inStreamRecords,
+                     properties* props=NULL);
+  
+  static Merger* create(const std::vector<std::pair<properties::tagType, properties::iterator> >& tags,
+                        std::map<std::string, streamRecord*>& outStreamRecords,
+                        std::vector<std::map<std::string, streamRecord*> >& inStreamRecords,
+                        properties* props)
+  { return new SampleElidedMerger(tags, outStreamRecords, inStreamRecords, props); }
+  
+  // Sets a list of strings that denotes a unique ID according to which instances of this merger's 
+  // tags should be differentiated for purposes of merging. Tags with different IDs will not be merged.
+  // Each level of the inheritance hierarchy may add zero or more elements to the given list and 
+  // call their parents so they can add any info. Keys from base classes must precede keys from derived classes.
+  static void mergeKey(properties::tagType type, properties::iterator tag, 
+                       std::map<std::string, streamRecord*>& inStreamRecords, MergeInfo& info);
+}; // class SampleElidedMerger
+
 
 int dbgprintf(const char * format, ... );
 
@@ -194,6 +194,9 @@ class traceStream: public attrObserver, public common::trace, public sightObj
   vizT viz;
   mergeT merge;
   
+  // The sampling policy that applies to this trace's observations or NULL if all observations are emitted
+  samplePolicy* sampling;
+  
   public:
   // Callers can optionally provide a traceID that this traceStream will use. This is useful for cases where 
   // the ID of the trace used within a given host object needs to be known before the traceStream is actually
@@ -214,6 +217,9 @@ class traceStream: public attrObserver, public common::trace, public sightObj
   
   public:
   ~traceStream();
+  
+  // Sets the sampling policy that applies to this trace's observations
+  void setSampling(samplePolicy* sampling) { this->sampling = sampling; }
 
   // Directly calls the destructor of this object. This is necessary because when an application crashes
   // Sight must clean up its state by calling the destructors of all the currently-active sightObjs. Since 